@@ -0,0 +1,377 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "defs.h"
+#if USE_ANSI_UI
+#include "ansi.h"
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <stdarg.h>
+#include <poll.h>
+
+// The login box needs only a few windows drawn on an otherwise blank
+// screen, so instead of terminfo this writes the ANSI sequences that
+// the Linux console and every terminal emulator understand. Windows are
+// drawn into a screen buffer and only the cells that differ from what
+// is on the screen are written out.
+
+//----------------------------------------------------------------------
+
+struct _win {
+    int		y, x, h, w;
+    int		cy, cx;		// Cursor position
+    chtype	attr;
+    chtype	bkgd;
+    bool	keypad;
+    chtype	cells [];	// h*w characters with attributes
+};
+
+enum {
+    MAX_COLOR_PAIRS = 8,
+    ESCAPE_DELAY = 50		// ms to wait for the rest of an escape sequence
+};
+
+//----------------------------------------------------------------------
+
+int LINES = 25, COLS = 80;
+WINDOW* curscr = NULL;
+
+static WINDOW* _stdscr = NULL;
+static chtype* _front = NULL;	// What is on the screen
+static chtype* _back = NULL;	// What should be on the screen
+static int _cursory = 0, _cursorx = 0;	// Where to leave the cursor
+static int _termy = 0, _termx = 0;	// Where the cursor is on the screen
+static chtype _termattr = 0;		// Current attributes on the screen
+static bool _clearall = false;		// Set by clearok to repaint everything
+static struct termios _savedti;
+static short _pairs [MAX_COLOR_PAIRS][2];
+static char _obuf [4096];
+static unsigned _olen = 0;
+
+//{{{ Output ----------------------------------------------------------
+
+static void Flush (void)
+{
+    for (unsigned i = 0; i < _olen;) {
+	ssize_t bw = write (STDOUT_FILENO, _obuf+i, _olen-i);
+	if (bw <= 0 && errno != EINTR)
+	    break;
+	else if (bw > 0)
+	    i += bw;
+    }
+    _olen = 0;
+}
+
+static void Put (const char* fmt, ...) __attribute__((format(printf,1,2)));
+static void Put (const char* fmt, ...)
+{
+    if (_olen > sizeof(_obuf)-32)
+	Flush();
+    va_list args;
+    va_start (args, fmt);
+    _olen += vsnprintf (_obuf+_olen, sizeof(_obuf)-_olen, fmt, args);
+    va_end (args);
+}
+
+//}}}-------------------------------------------------------------------
+//{{{ Screen
+
+WINDOW* initscr (void)
+{
+    struct winsize ws;
+    if (0 == ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_row && ws.ws_col) {
+	LINES = ws.ws_row;
+	COLS = ws.ws_col;
+    }
+    // Keys are read one at a time; signal keys are left to the tty
+    if (0 != tcgetattr (STDIN_FILENO, &_savedti))
+	return (NULL);
+    struct termios ti = _savedti;
+    ti.c_lflag &= ~ICANON;
+    ti.c_cc[VMIN] = 1;
+    ti.c_cc[VTIME] = 0;
+    if (0 != tcsetattr (STDIN_FILENO, TCSANOW, &ti))
+	return (NULL);
+
+    const size_t scrsz = LINES*COLS*sizeof(chtype);
+    _front = (chtype*) xmalloc (scrsz);
+    _back = (chtype*) xmalloc (scrsz);
+    for (int i = 0; i < LINES*COLS; ++i)
+	_front[i] = _back[i] = ' ';
+    Put ("\e[0m\e[H\e[J");
+    _termy = _termx = 0;
+    _termattr = 0;
+    return (curscr = _stdscr = newwin (LINES, COLS, 0, 0));
+}
+
+int endwin (void)
+{
+    if (!_stdscr)
+	return (ERR);
+    Put ("\e[0m\e[%d;1H", LINES);
+    Flush();
+    tcsetattr (STDIN_FILENO, TCSANOW, &_savedti);
+    delwin (_stdscr);
+    curscr = _stdscr = NULL;
+    xfree (_front);
+    xfree (_back);
+    _front = _back = NULL;
+    return (OK);
+}
+
+bool isendwin (void)
+{
+    return (!_stdscr);
+}
+
+int start_color (void)
+{
+    return (OK);
+}
+
+int use_default_colors (void)
+{
+    return (OK);
+}
+
+int init_pair (short pair, short fg, short bg)
+{
+    if (pair <= 0 || pair >= MAX_COLOR_PAIRS)
+	return (ERR);
+    _pairs[pair][0] = fg;
+    _pairs[pair][1] = bg;
+    return (OK);
+}
+
+// Makes the next update clear the screen and repaint it, as after line noise
+int clearok (WINDOW* win __attribute__((unused)), bool bf)
+{
+    _clearall = bf;
+    return (OK);
+}
+
+int noecho (void)
+{
+    struct termios ti;
+    if (0 != tcgetattr (STDIN_FILENO, &ti))
+	return (ERR);
+    ti.c_lflag &= ~ECHO;
+    return (tcsetattr (STDIN_FILENO, TCSANOW, &ti) ? ERR : OK);
+}
+
+static void PutAttr (chtype attr)
+{
+    Put ("\e[0");
+    if (attr & A_REVERSE)
+	Put (";7");
+    const unsigned pair = (attr & A_COLOR) >> 8;
+    if (pair && pair < MAX_COLOR_PAIRS) {
+	// Negative colors are terminal defaults
+	if (_pairs[pair][0] >= 0)
+	    Put (";%d", 30+_pairs[pair][0]);
+	if (_pairs[pair][1] >= 0)
+	    Put (";%d", 40+_pairs[pair][1]);
+    }
+    Put ("m");
+}
+
+// Writes out the cells that changed since the last update
+int doupdate (void)
+{
+    if (!_stdscr)
+	return (ERR);
+    if (_clearall) {
+	Put ("\e[0m\e[H\e[J");
+	for (int i = 0; i < LINES*COLS; ++i)
+	    _front[i] = ' ';
+	_termy = _termx = 0;
+	_termattr = 0;
+	_clearall = false;
+    }
+    for (int r = 0; r < LINES; ++r) {
+	for (int c = 0; c < COLS; ++c) {
+	    const chtype ch = _back[r*COLS+c];
+	    if (ch == _front[r*COLS+c])
+		continue;
+	    if (r == _termy && c+1 == _termx)
+		Put ("\b");	// As when erasing the last typed character
+	    else if (r != _termy || c != _termx)
+		Put ("\e[%d;%dH", r+1, c+1);
+	    if ((ch & ~A_CHARTEXT) != _termattr)
+		PutAttr (_termattr = ch & ~A_CHARTEXT);
+	    Put ("%c", (char)(ch & A_CHARTEXT));
+	    _front[r*COLS+c] = ch;
+	    _termy = r;
+	    _termx = c+1;
+	}
+    }
+    if (_cursory == _termy && _cursorx+1 == _termx)
+	Put ("\b");
+    else if (_cursory != _termy || _cursorx != _termx)
+	Put ("\e[%d;%dH", _cursory+1, _cursorx+1);
+    _termy = _cursory;
+    _termx = _cursorx;
+    Flush();
+    return (OK);
+}
+
+//}}}-------------------------------------------------------------------
+//{{{ Windows
+
+WINDOW* newwin (int h, int w, int y, int x)
+{
+    if (h <= 0 || w <= 0 || y < 0 || x < 0 || y+h > LINES || x+w > COLS)
+	return (NULL);
+    WINDOW* win = (WINDOW*) xmalloc (sizeof(WINDOW) + h*w*sizeof(chtype));
+    win->y = y;
+    win->x = x;
+    win->h = h;
+    win->w = w;
+    win->bkgd = ' ';
+    werase (win);
+    return (win);
+}
+
+int delwin (WINDOW* win)
+{
+    xfree (win);
+    return (OK);
+}
+
+int keypad (WINDOW* win, bool on)
+{
+    win->keypad = on;
+    return (OK);
+}
+
+int nodelay (WINDOW* win __attribute__((unused)), bool on)
+{
+    return (on ? ERR : OK);	// Only blocking input is supported
+}
+
+void wbkgdset (WINDOW* win, chtype ch)
+{
+    win->bkgd = ch;
+}
+
+int wbkgd (WINDOW* win, chtype ch)
+{
+    wbkgdset (win, ch);
+    return (werase (win));
+}
+
+int wattrset (WINDOW* win, chtype attr)
+{
+    win->attr = attr;
+    return (OK);
+}
+
+int werase (WINDOW* win)
+{
+    for (int i = 0; i < win->h*win->w; ++i)
+	win->cells[i] = win->bkgd;
+    win->cy = win->cx = 0;
+    return (OK);
+}
+
+int wmove (WINDOW* win, int y, int x)
+{
+    if (y < 0 || y >= win->h || x < 0 || x >= win->w)
+	return (ERR);
+    win->cy = y;
+    win->cx = x;
+    return (OK);
+}
+
+// Writes up to n characters of s, or all of it if n is negative, clipped to the window
+int mvwaddnstr (WINDOW* win, int y, int x, const char* s, int n)
+{
+    if (y < 0 || y >= win->h || x < 0 || x >= win->w)
+	return (ERR);
+    chtype attr = win->attr;
+    if (!(attr & A_COLOR))
+	attr |= win->bkgd & A_COLOR;
+    for (; *s && n-- && x < win->w; ++s, ++x)
+	win->cells[y*win->w+x] = attr | (unsigned char) *s;
+    win->cy = y;
+    win->cx = x < win->w ? x : win->w-1;
+    return (OK);
+}
+
+int mvwaddstr (WINDOW* win, int y, int x, const char* s)
+{
+    return (mvwaddnstr (win, y, x, s, -1));
+}
+
+int mvwprintw (WINDOW* win, int y, int x, const char* fmt, ...)
+{
+    char buf [256];
+    va_list args;
+    va_start (args, fmt);
+    vsnprintf (buf, sizeof(buf), fmt, args);
+    va_end (args);
+    return (mvwaddstr (win, y, x, buf));
+}
+
+// Copies the window to the screen buffer, to be written by doupdate
+int wnoutrefresh (WINDOW* win)
+{
+    if (!_back)
+	return (ERR);
+    for (int r = 0; r < win->h; ++r)
+	memcpy (&_back[(win->y+r)*COLS+win->x], &win->cells[r*win->w], win->w*sizeof(chtype));
+    _cursory = win->y + win->cy;
+    _cursorx = win->x + win->cx;
+    return (OK);
+}
+
+//}}}-------------------------------------------------------------------
+//{{{ Keyboard
+
+// Returns the next byte from the tty, or ERR if none arrives in timeout ms
+static int ReadByte (int timeout)
+{
+    if (timeout >= 0) {
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	if (0 >= poll (&pfd, 1, timeout))
+	    return (ERR);
+    }
+    unsigned char c;
+    ssize_t br;
+    while (0 > (br = read (STDIN_FILENO, &c, sizeof(c))) && errno == EINTR) {}
+    return (br == sizeof(c) ? c : ERR);
+}
+
+int wgetch (WINDOW* win)
+{
+    Flush();
+    int c = ReadByte (-1);
+    if (!win->keypad)
+	return (c);
+    if (c == 127 || c == '\b')
+	return (KEY_BACKSPACE);
+    if (c != '\e')
+	return (c);
+
+    // Cursor keys send ESC [ x or ESC O x. A lone ESC is the escape key.
+    if ((c = ReadByte (ESCAPE_DELAY)) == ERR)
+	return ('\e');
+    if (c != '[' && c != 'O')
+	return (ERR);
+    do {	// Skip any parameters, as in ESC [ 1 ; 2 A
+	c = ReadByte (ESCAPE_DELAY);
+    } while (c != ERR && ((c >= '0' && c <= '9') || c == ';'));
+    switch (c) {
+	case 'A':	return (KEY_UP);
+	case 'B':	return (KEY_DOWN);
+	case 'C':	return (KEY_RIGHT);
+	case 'D':	return (KEY_LEFT);
+	case 'Z':	return (KEY_BTAB);
+	default:	return (ERR);	// Keys the login box does not use
+    }
+}
+
+//}}}-------------------------------------------------------------------
+#endif
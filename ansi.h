@@ -0,0 +1,65 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// The subset of the curses interface used by the login box, implemented
+// with ANSI escape sequences to avoid linking ncurses. See ansi.c.
+
+#pragma once
+
+typedef unsigned chtype;
+typedef struct _win WINDOW;
+
+#define A_CHARTEXT	0xffu
+#define A_COLOR		0xff00u
+#define A_REVERSE	0x10000u
+#define COLOR_PAIR(n)	((chtype)(n) << 8)
+
+enum {
+    ERR = -1,
+    OK = 0
+};
+
+enum {
+    COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
+    COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE
+};
+
+// Key codes have the same values as in ncurses
+enum {
+    KEY_DOWN = 0402,
+    KEY_UP,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_BACKSPACE = 0407,
+    KEY_BTAB = 0541,
+    KEY_MAX = 0777
+};
+
+extern int LINES, COLS;
+extern WINDOW* curscr;
+
+WINDOW* initscr (void);
+int endwin (void);
+bool isendwin (void);
+int start_color (void);
+int use_default_colors (void);
+int init_pair (short pair, short fg, short bg);
+int noecho (void);
+int clearok (WINDOW* win, bool bf);
+WINDOW* newwin (int h, int w, int y, int x);
+int delwin (WINDOW* win);
+int keypad (WINDOW* win, bool on);
+int nodelay (WINDOW* win, bool on);
+int wbkgd (WINDOW* win, chtype ch);
+void wbkgdset (WINDOW* win, chtype ch);
+int wattrset (WINDOW* win, chtype attr);
+int werase (WINDOW* win);
+int wmove (WINDOW* win, int y, int x);
+int mvwaddnstr (WINDOW* win, int y, int x, const char* s, int n);
+int mvwaddstr (WINDOW* win, int y, int x, const char* s);
+int mvwprintw (WINDOW* win, int y, int x, const char* fmt, ...) __attribute__((format(printf,4,5)));
+int wnoutrefresh (WINDOW* win);
+int doupdate (void);
+int wgetch (WINDOW* win);
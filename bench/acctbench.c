@@ -0,0 +1,142 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../defs.h"
+#include <pwd.h>
+
+// Measures reading the account list from a passwd with many accounts.
+// The baseline is the original reader, which counted the accounts in
+// one getpwent pass and copied them in a second, into an allocation for
+// each account plus three strdups. It is compared with ReadAccounts of
+// uacct.c, which builds the list in one pass into a record array and a
+// string pool, and with loading the list from the account snapshot.
+// Each load runs in a new process, as it does in loginx.
+
+//----------------------------------------------------------------------
+
+enum {
+    DEFAULT_ITERATIONS	= 100,
+    DEFAULT_ACCOUNTS	= 20000
+};
+
+struct sample {
+    uint64_t	ns;
+    unsigned	allocs;
+    unsigned	getpwents;
+};
+
+// Linked with --wrap=getpwent, to count NSS round trips
+struct passwd* __real_getpwent (void);
+static unsigned _getpwents = 0;
+
+struct passwd* __wrap_getpwent (void)
+{
+    ++_getpwents;
+    return (__real_getpwent());
+}
+
+//----------------------------------------------------------------------
+
+static bool CanLogin (const struct passwd* pw)
+{
+    return (pw->pw_shell && strcmp(pw->pw_shell, "/bin/false") && strcmp(pw->pw_shell,"/sbin/nologin"));
+}
+
+static char* CountedStrdup (const char* s)
+{
+    ++_benchallocs;
+    return (strdup (s));
+}
+
+static void TwoPassStrdup (void* sample)
+{
+    struct sample* s = (struct sample*) sample;
+    const uint64_t t0 = BenchNow();
+
+    unsigned nac = 0;
+    setpwent();
+    for (struct passwd* pw; (pw = getpwent());)
+	nac += CanLogin (pw);
+    struct account** accts = (struct account**) xmalloc ((nac+1)*sizeof(struct account*));
+    nac = 0;
+    setpwent();
+    for (struct passwd* pw; (pw = getpwent());) {
+	if (!CanLogin (pw))
+	    continue;
+	accts[nac] = (struct account*) xmalloc (sizeof(struct account));
+	accts[nac]->uid = pw->pw_uid;
+	accts[nac]->gid = pw->pw_gid;
+	accts[nac]->name = CountedStrdup (pw->pw_name);
+	accts[nac]->dir = CountedStrdup (pw->pw_dir);
+	accts[nac]->shell = CountedStrdup (pw->pw_shell);
+	++nac;
+    }
+    endpwent();
+
+    s->ns = BenchNow() - t0;
+    s->allocs = _benchallocs;
+    s->getpwents = _getpwents;
+}
+
+static void LoadAccountList (bool rebuild, struct sample* s)
+{
+    LoadAccounts (rebuild);
+    AccountsLoaded();	// Waits for the loader thread
+    if (!NAccounts())
+	ExitWithMessage ("no accounts loaded");
+    s->ns = BenchPhase ("ReadAccounts", &s->allocs);
+    s->getpwents = _getpwents;
+}
+
+static void SinglePassArena (void* sample)
+{
+    LoadAccountList (true, (struct sample*) sample);
+}
+
+static void FromSnapshot (void* sample)
+{
+    LoadAccountList (false, (struct sample*) sample);
+}
+
+static void Measure (const char* name, void (*fn)(void* sample), unsigned n)
+{
+    uint64_t* ns = (uint64_t*) calloc (n, sizeof(uint64_t));
+    if (!ns)
+	BenchError ("calloc");
+    struct sample s = {0};
+    for (unsigned i = 0; i < n; ++i) {
+	BenchInChild (fn, &s, sizeof(s));
+	ns[i] = s.ns;
+    }
+    BenchReport (name, ns, n);
+    printf ("%-24s %u allocations, %u getpwent calls\n", "", s.allocs, s.getpwents);
+    free (ns);
+}
+
+int main (int argc, char* const* argv)
+{
+    static const char c_Usage[] = "acctbench [-n iterations] [-a accounts]";
+    unsigned niters = DEFAULT_ITERATIONS, naccounts = DEFAULT_ACCOUNTS;
+    for (int opt; 0 < (opt = getopt (argc, argv, "n:a:"));) {
+	if (opt == 'n')
+	    niters = strtoul (optarg, NULL, 0);
+	else if (opt == 'a')
+	    naccounts = strtoul (optarg, NULL, 0);
+	else
+	    BenchUsage (c_Usage);
+    }
+    if (argc != optind || !niters || !naccounts)
+	BenchUsage (c_Usage);
+
+    BenchNamespace();
+    BenchWritePasswd (naccounts, 1, "/bin/sh");
+    printf ("Reading %u accounts\n", naccounts);
+
+    Measure ("two-pass-strdup", TwoPassStrdup, niters);
+    Measure ("single-pass-arena", SinglePassArena, niters);
+    Measure ("snapshot", FromSnapshot, niters);
+    return (EXIT_SUCCESS);
+}
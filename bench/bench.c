@@ -0,0 +1,208 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//----------------------------------------------------------------------
+
+static char _scratch [] = "/tmp/loginx-bench.XXXXXX";
+static pid_t _scratchowner = 0;
+
+//----------------------------------------------------------------------
+
+void BenchError (const char* fn)
+{
+    fprintf (stderr, "Error: %s: %s\n", fn, strerror(errno));
+    exit (EXIT_FAILURE);
+}
+
+void BenchUsage (const char* usage)
+{
+    fprintf (stderr, "Usage: %s\n", usage);
+    exit (EXIT_FAILURE);
+}
+
+static void BenchCleanup (void)
+{
+    if (getpid() != _scratchowner)
+	return;
+    umount2 (_scratch, MNT_DETACH);
+    rmdir (_scratch);
+}
+
+static void BenchMkdir (const char* path)
+{
+    if (0 != mkdir (path, 0755) && errno != EEXIST)
+	BenchError (path);
+}
+
+// The file is dated a minute back, so an account snapshot taken by
+// loginx right after it is written is not considered stale.
+void BenchWriteFile (const char* path, const char* data, size_t sz)
+{
+    int fd = open (path, O_WRONLY| O_CREAT| O_TRUNC| O_CLOEXEC, 0644);
+    if (fd < 0 || (ssize_t) sz != write (fd, data, sz))
+	BenchError (path);
+    struct timespec t [2];
+    clock_gettime (CLOCK_REALTIME, &t[0]);
+    t[0].tv_sec -= 60;
+    t[1] = t[0];
+    if (0 != futimens (fd, t) || 0 != close (fd))
+	BenchError (path);
+}
+
+// Mounts path over target
+void BenchBind (const char* path, const char* target)
+{
+    if (0 != mount (path, target, NULL, MS_BIND, NULL))
+	BenchError (target);
+}
+
+// Hides target, if it exists, under an empty directory or file from the scratch
+static void BenchHide (const char* target)
+{
+    struct stat st;
+    if (0 != lstat (target, &st))
+	return;
+    char path [PATH_MAX];
+    snprintf (path, sizeof(path), "%s/%s", _scratch, S_ISDIR(st.st_mode) ? "empty" : "emptyfile");
+    BenchBind (path, target);
+}
+
+static void BenchTmpfs (const char* target)
+{
+    struct stat st;
+    if (0 == stat (target, &st) && S_ISDIR(st.st_mode) && 0 != mount ("none", target, "tmpfs", 0, "mode=755"))
+	BenchError (target);
+}
+
+// Enters a private mount namespace with the scratch tmpfs mounted over
+// the system files loginx uses. Returns the scratch directory.
+const char* BenchNamespace (void)
+{
+    if (geteuid())
+	BenchUsage ("benchmarks must be run as root, to mount their scratch files in a private namespace");
+    if (0 != unshare (CLONE_NEWNS) || 0 != mount (NULL, "/", NULL, MS_REC| MS_PRIVATE, NULL))
+	BenchError ("unshare");
+    if (!mkdtemp (_scratch))
+	BenchError ("mkdtemp");
+    if (0 != mount ("none", _scratch, "tmpfs", 0, "mode=755"))
+	BenchError (_scratch);
+    _scratchowner = getpid();
+    atexit (BenchCleanup);
+
+    char path [PATH_MAX];
+    static const char c_Dirs[][8] = { "etc", "empty", "home" };
+    for (unsigned i = 0; i < sizeof(c_Dirs)/sizeof(c_Dirs[0]); ++i) {
+	snprintf (path, sizeof(path), "%s/%s", _scratch, c_Dirs[i]);
+	BenchMkdir (path);
+    }
+    snprintf (path, sizeof(path), "%s/emptyfile", _scratch);
+    BenchWriteFile (path, "", 0);
+
+    // Accounts only from the generated files
+    static const char c_NssConf[] = "passwd: files\ngroup: files\nshadow: files\n";
+    snprintf (path, sizeof(path), "%s/etc/nsswitch.conf", _scratch);
+    BenchWriteFile (path, c_NssConf, sizeof(c_NssConf)-1);
+    BenchBind (path, "/etc/nsswitch.conf");
+
+    // The message of the day is not measured
+    BenchHide (PATH_MOTD);
+    BenchHide (PATH_MOTD_DIR);
+    BenchHide (PATH_MOTD_GENERATORS);
+
+    // Caches, state, and login records start empty
+    BenchTmpfs ("/var/cache");
+    BenchTmpfs ("/var/lib");
+    BenchTmpfs ("/var/log");
+    BenchTmpfs ("/run");
+    return (_scratch);
+}
+
+// Writes a passwd with n accounts named benchN, with uids BENCH_FIRST_UID
+// apart by uidstep, and a group file, and mounts them over the system ones.
+void BenchWritePasswd (unsigned n, uid_t uidstep, const char* shell)
+{
+    size_t cap = 64 + n*(64 + sizeof(_scratch) + strlen(shell)), sz = 0;
+    char* buf = (char*) malloc (cap);
+    if (!buf)
+	BenchError ("malloc");
+    sz += snprintf (buf+sz, cap-sz, "root:x:0:0:root:/root:/bin/sh\n");
+    for (unsigned i = 0; i < n; ++i)
+	sz += snprintf (buf+sz, cap-sz, "bench%u:x:%u:%u:Benchmark:%s/home:%s\n",
+			i, BENCH_FIRST_UID + i*uidstep, BENCH_FIRST_UID, _scratch, shell);
+    char path [PATH_MAX];
+    snprintf (path, sizeof(path), "%s/etc/passwd", _scratch);
+    BenchWriteFile (path, buf, sz);
+    BenchBind (path, "/etc/passwd");
+    free (buf);
+
+    static const char c_Group[] = "root:x:0:\ntty:x:5:\nbench:x:10000:\n";
+    snprintf (path, sizeof(path), "%s/etc/group", _scratch);
+    BenchWriteFile (path, c_Group, sizeof(c_Group)-1);
+    BenchBind (path, "/etc/group");
+}
+
+// In nanoseconds
+uint64_t BenchNow (void)
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return (t.tv_sec*UINT64_C(1000000000) + t.tv_nsec);
+}
+
+static int CompareSamples (const void* a, const void* b)
+{
+    const uint64_t sa = *(const uint64_t*) a, sb = *(const uint64_t*) b;
+    return (sa < sb ? -1 : sa > sb);
+}
+
+// Prints the distribution of samples in nanoseconds, as ms
+void BenchReport (const char* name, uint64_t* samples, unsigned n)
+{
+    if (!n)
+	return;
+    qsort (samples, n, sizeof(samples[0]), CompareSamples);
+    #define MS(i)	(samples[i]/1e6)
+    printf ("%-24s n=%-6u min %9.3f  med %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n",
+	    name, n, MS(0), MS(n/2), MS(n*9/10), MS(n*99/100), MS(n-1));
+    #undef MS
+}
+
+// Runs fn in a forked child, for measuring code that can only run once
+// in a process, and copies back the sample it fills.
+void BenchInChild (void (*fn)(void* sample), void* sample, size_t samplesz)
+{
+    int p [2];
+    if (0 != pipe2 (p, O_CLOEXEC))
+	BenchError ("pipe2");
+    fflush (stdout);
+    pid_t pid = fork();
+    if (!pid) {
+	close (p[0]);
+	fn (sample);
+	if ((ssize_t) samplesz != write (p[1], sample, samplesz))
+	    BenchError ("write sample");
+	exit (EXIT_SUCCESS);
+    } else if (pid < 0)
+	BenchError ("fork");
+    close (p[1]);
+    ssize_t br = read (p[0], sample, samplesz);
+    close (p[0]);
+    int status = 0;
+    while (0 > waitpid (pid, &status, 0))
+	if (errno != EINTR)
+	    BenchError ("waitpid");
+    if (br != (ssize_t) samplesz || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+	fprintf (stderr, "Error: benchmark child failed\n");
+	exit (EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,40 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "../config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// The benchmarks run in a private mount namespace, where a scratch
+// tmpfs with a generated passwd and group, a local PAM configuration,
+// and empty login record and cache directories is mounted over the
+// system ones. So they need root, but change nothing outside, and no
+// console is needed.
+
+enum { BENCH_FIRST_UID = 10000 };
+
+//----------------------------------------------------------------------
+
+// bench.c
+void BenchError (const char* fn) __attribute__((noreturn));
+void BenchUsage (const char* usage) __attribute__((noreturn));
+const char* BenchNamespace (void);
+void BenchWriteFile (const char* path, const char* data, size_t sz);
+void BenchBind (const char* path, const char* target);
+void BenchWritePasswd (unsigned n, uid_t uidstep, const char* shell);
+uint64_t BenchNow (void);
+void BenchReport (const char* name, uint64_t* samples, unsigned n);
+void BenchInChild (void (*fn)(void* sample), void* sample, size_t samplesz);
+
+// stubs.c, standing in for loginx.c when linking parts of loginx
+extern unsigned _benchallocs;
+uint64_t BenchPhase (const char* name, unsigned* allocs);
@@ -0,0 +1,187 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../defs.h"
+#include <fcntl.h>
+#include <utmp.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// Measures reading last login times of many accounts with uids spread
+// over a wide range, as from a directory service, so that the lastlog
+// is a huge sparse file. The baseline is the original reader, which
+// made one pread per account. It is compared with ReadLastlog of
+// uacct.c, run as on a start from the account snapshot with a lastlog
+// changed since, so that only the lastlog is read.
+
+//----------------------------------------------------------------------
+
+enum {
+    DEFAULT_ITERATIONS	= 100,
+    DEFAULT_ACCOUNTS	= 100000,
+    DEFAULT_UID_STEP	= 1000,
+    DEFAULT_LOGGED_IN	= 10	// One in this many accounts has a lastlog record
+};
+
+struct sample {
+    uint64_t	ns;
+    unsigned	preads;
+    unsigned	lseeks;
+};
+
+static unsigned _naccounts = DEFAULT_ACCOUNTS;
+static uid_t _uidstep = DEFAULT_UID_STEP;
+
+// Linked with --wrap=pread,--wrap=lseek, to count syscalls
+ssize_t __real_pread (int fd, void* buf, size_t n, off_t o);
+off_t __real_lseek (int fd, off_t o, int whence);
+static unsigned _preads = 0, _lseeks = 0;
+
+ssize_t __wrap_pread (int fd, void* buf, size_t n, off_t o)
+{
+    ++_preads;
+    return (__real_pread (fd, buf, n, o));
+}
+
+off_t __wrap_lseek (int fd, off_t o, int whence)
+{
+    ++_lseeks;
+    return (__real_lseek (fd, o, whence));
+}
+
+//----------------------------------------------------------------------
+
+static uid_t AccountUid (unsigned i)
+{
+    return (BENCH_FIRST_UID + i*_uidstep);
+}
+
+static void WriteLastlogRecords (unsigned loggedin)
+{
+    int fd = open (_PATH_LASTLOG, O_WRONLY| O_CREAT| O_TRUNC| O_CLOEXEC, 0644);
+    if (fd < 0)
+	BenchError (_PATH_LASTLOG);
+    struct lastlog ll;
+    memset (&ll, 0, sizeof(ll));
+    strncpy (ll.ll_line, "tty1", sizeof(ll.ll_line)-1);
+    for (unsigned i = 0; i < _naccounts; i += loggedin) {
+	ll.ll_time = time (NULL) - i;
+	if (sizeof(ll) != pwrite (fd, &ll, sizeof(ll), (off_t) AccountUid(i)*sizeof(ll)))
+	    BenchError ("pwrite lastlog");
+    }
+    close (fd);
+#if USE_LASTLOG_DB
+    // loginx reads its own database instead
+    for (unsigned i = 0; i < _naccounts; i += loggedin) {
+	char name [16];
+	snprintf (name, sizeof(name), "bench%u", i);
+	const struct account acct = { .uid = AccountUid(i), .name = name };
+	WriteLastlog (&acct);
+    }
+#endif
+}
+
+// Dates the lastlog after the snapshot, so that loginx rereads it
+static void TouchLastlog (void)
+{
+    if (0 != utimensat (AT_FDCWD, PATH_LASTLOG, NULL, 0))
+	BenchError (PATH_LASTLOG);
+}
+
+static void PreadPerAccount (void* sample)
+{
+    struct sample* s = (struct sample*) sample;
+    uint32_t* ltimes = (uint32_t*) calloc (_naccounts, sizeof(uint32_t));
+    if (!ltimes)
+	BenchError ("calloc");
+    const uint64_t t0 = BenchNow();
+
+    int fd = open (_PATH_LASTLOG, O_RDONLY);
+    if (fd < 0)
+	BenchError (_PATH_LASTLOG);
+    struct stat st;
+    if (fstat (fd, &st) == 0) {
+	const uid_t maxuid = st.st_size / sizeof(struct lastlog);
+	for (unsigned i = 0; i < _naccounts; ++i)
+	    if (AccountUid(i) < maxuid)
+		pread (fd, &ltimes[i], sizeof(ltimes[i]), (off_t) AccountUid(i) * sizeof(struct lastlog));
+    }
+    close (fd);
+
+    s->ns = BenchNow() - t0;
+    s->preads = _preads;
+    s->lseeks = _lseeks;
+    free (ltimes);
+}
+
+static void LoadAccountList (bool rebuild, struct sample* s)
+{
+    LoadAccounts (rebuild);
+    AccountsLoaded();	// Waits for the loader thread
+    if (NAccounts() < _naccounts)
+	ExitWithMessage ("not all accounts loaded");
+    s->ns = BenchPhase ("ReadLastlog", NULL);
+    s->preads = _preads;
+    s->lseeks = _lseeks;
+}
+
+static void TakeSnapshot (void* sample)
+{
+    LoadAccountList (true, (struct sample*) sample);
+}
+
+static void BatchedSparse (void* sample)
+{
+    LoadAccountList (false, (struct sample*) sample);
+}
+
+static void Measure (const char* name, void (*fn)(void* sample), unsigned n)
+{
+    uint64_t* ns = (uint64_t*) calloc (n, sizeof(uint64_t));
+    if (!ns)
+	BenchError ("calloc");
+    struct sample s = {0};
+    for (unsigned i = 0; i < n; ++i) {
+	TouchLastlog();
+	BenchInChild (fn, &s, sizeof(s));
+	ns[i] = s.ns;
+    }
+    BenchReport (name, ns, n);
+    printf ("%-24s %u preads, %u lseeks\n", "", s.preads, s.lseeks);
+    free (ns);
+}
+
+int main (int argc, char* const* argv)
+{
+    static const char c_Usage[] = "lastlogbench [-n iterations] [-a accounts] [-u uidstep] [-l loggedin_1_in]";
+    unsigned niters = DEFAULT_ITERATIONS, loggedin = DEFAULT_LOGGED_IN;
+    for (int opt; 0 < (opt = getopt (argc, argv, "n:a:u:l:"));) {
+	if (opt == 'n')
+	    niters = strtoul (optarg, NULL, 0);
+	else if (opt == 'a')
+	    _naccounts = strtoul (optarg, NULL, 0);
+	else if (opt == 'u')
+	    _uidstep = strtoul (optarg, NULL, 0);
+	else if (opt == 'l')
+	    loggedin = strtoul (optarg, NULL, 0);
+	else
+	    BenchUsage (c_Usage);
+    }
+    if (argc != optind || !niters || !_naccounts || !_uidstep || !loggedin)
+	BenchUsage (c_Usage);
+
+    BenchNamespace();
+    BenchWritePasswd (_naccounts, _uidstep, "/bin/sh");
+    WriteLastlogRecords (loggedin);
+    printf ("Reading last logins of %u accounts with uids %u to %u, %u logged in\n",
+	    _naccounts, AccountUid(0), AccountUid(_naccounts-1), (_naccounts+loggedin-1)/loggedin);
+
+    struct sample s;
+    BenchInChild (TakeSnapshot, &s, sizeof(s));
+    Measure ("pread-per-account", PreadPerAccount, niters);
+    Measure ("batched-sparse", BatchedSparse, niters);
+    return (EXIT_SUCCESS);
+}
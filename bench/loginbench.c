@@ -0,0 +1,250 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Drives loginx on a pty with scripted keystrokes, and measures what the
+// user waits for: the time from start to the password prompt, from each
+// keystroke to its echo, from Enter to the shell, and from logout to the
+// next prompt. loginx runs persistent, so logins follow each other on
+// the same process, as they do on a console. The shell is this program,
+// started as a login shell, which prints a marker and exits on a newline.
+
+//----------------------------------------------------------------------
+
+enum {
+    DEFAULT_LOGINS	= 1000,
+    DEFAULT_STARTS	= 100,
+    DEFAULT_ACCOUNTS	= 1000,
+    EXPECT_TIMEOUT	= 10000	// ms
+};
+
+#define BENCH_PASSWORD	"bench"
+#define SHELL_MARKER	"LOGINBENCH-SHELL"
+
+static const char* _loginx = NULL;
+static int _ptm = -1;		// The pty master, on which the user types
+static char _ptsname [16];	// Slave name relative to /dev, as loginx takes it
+
+//----------------------------------------------------------------------
+
+static int RunShell (void)
+{
+    static const char c_Marker[] = "\n" SHELL_MARKER "\n";
+    if (write (STDOUT_FILENO, c_Marker, sizeof(c_Marker)-1) < 0)
+	return (EXIT_FAILURE);
+    for (char c = 0; c != '\n' && 1 == read (STDIN_FILENO, &c, 1);) {}
+    return (EXIT_SUCCESS);
+}
+
+static void WritePamConfig (const char* scratch, const char* module, unsigned delay)
+{
+    char path [PATH_MAX], conf [PATH_MAX+128];
+    snprintf (path, sizeof(path), "%s/etc/pam.d", scratch);
+    if (0 != mkdir (path, 0755))
+	BenchError (path);
+    int confsz = snprintf (conf, sizeof(conf),
+	    "auth required %s delay=%u\n"
+	    "account required pam_permit.so\n"
+	    "session required pam_permit.so\n", module, delay);
+    snprintf (path, sizeof(path), "%s/etc/pam.d/" LOGINX_PAM_SERVICE, scratch);
+    BenchWriteFile (path, conf, confsz);
+    snprintf (path, sizeof(path), "%s/etc/pam.d", scratch);
+    BenchBind (path, "/etc/pam.d");
+}
+
+// The shell must be executable by the benchmark accounts
+static void CopyShell (const char* self, const char* shell)
+{
+    int ifd = open (self, O_RDONLY| O_CLOEXEC), ofd = open (shell, O_WRONLY| O_CREAT| O_TRUNC| O_CLOEXEC, 0755);
+    if (ifd < 0 || ofd < 0)
+	BenchError ("open shell");
+    char buf [BUFSIZ];
+    for (ssize_t br; 0 < (br = read (ifd, buf, sizeof(buf)));)
+	if (br != write (ofd, buf, br))
+	    BenchError ("write shell");
+    close (ifd);
+    if (0 != close (ofd))
+	BenchError ("close shell");
+}
+
+static int OpenPty (void)
+{
+    int fd = posix_openpt (O_RDWR| O_NOCTTY| O_CLOEXEC);
+    if (fd < 0 || grantpt (fd) || unlockpt (fd))
+	BenchError ("posix_openpt");
+    const char* name = ptsname (fd);
+    if (!name || strncmp (name, "/dev/", strlen("/dev/")) || strlen(name+strlen("/dev/")) >= sizeof(_ptsname))
+	BenchError ("ptsname");
+    strcpy (_ptsname, name+strlen("/dev/"));
+    static const struct winsize c_ws = { .ws_row = 25, .ws_col = 80 };
+    if (0 != ioctl (fd, TIOCSWINSZ, &c_ws))
+	BenchError ("TIOCSWINSZ");
+    return (fd);
+}
+
+// Reads loginx output until s is seen
+static void Expect (const char* s)
+{
+    const size_t slen = strlen(s);
+    for (size_t m = 0; m < slen;) {
+	struct pollfd pfd = { _ptm, POLLIN, 0 };
+	int r = poll (&pfd, 1, EXPECT_TIMEOUT);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	else if (r <= 0) {
+	    fprintf (stderr, "Error: timed out waiting for \"%s\"\n", s);
+	    exit (EXIT_FAILURE);
+	}
+	char buf [BUFSIZ];
+	ssize_t br = read (_ptm, buf, sizeof(buf));
+	if (br < 0 && errno != EINTR && errno != EAGAIN)
+	    BenchError ("read pty");
+	for (ssize_t i = 0; i < br && m < slen; ++i)
+	    m = (buf[i] == s[m]) ? m+1 : (buf[i] == s[0]);
+    }
+}
+
+// Discards the output of a stopped loginx
+static void Drain (void)
+{
+    char buf [BUFSIZ];
+    for (struct pollfd pfd = { _ptm, POLLIN, 0 }; 0 < poll (&pfd, 1, 0) && 0 < read (_ptm, buf, sizeof(buf));) {}
+}
+
+static void Type (const char* keys)
+{
+    if ((ssize_t) strlen(keys) != write (_ptm, keys, strlen(keys)))
+	BenchError ("write pty");
+}
+
+static pid_t StartLoginx (void)
+{
+    pid_t pid = fork();
+    if (!pid) {
+	execl (_loginx, _loginx, "-p", _ptsname, "38400", "linux", NULL);
+	BenchError ("execl");
+    } else if (pid < 0)
+	BenchError ("fork");
+    return (pid);
+}
+
+static void StopLoginx (pid_t pid)
+{
+    kill (pid, SIGTERM);
+    int status = 0;
+    while (0 > waitpid (pid, &status, 0))
+	if (errno != EINTR)
+	    BenchError ("waitpid");
+    Drain();
+}
+
+//----------------------------------------------------------------------
+
+int main (int argc, char* const* argv)
+{
+    if (argv[0][0] == '-')	// Started by loginx as the login shell
+	return (RunShell());
+
+    static const char c_Usage[] = "loginbench [-n logins] [-s starts] [-a accounts] [-d authdelay_us] loginx pam_bench.so";
+    unsigned nlogins = DEFAULT_LOGINS, nstarts = DEFAULT_STARTS, naccounts = DEFAULT_ACCOUNTS, authdelay = 0;
+    for (int opt; 0 < (opt = getopt (argc, argv, "n:s:a:d:"));) {
+	if (opt == 'n')
+	    nlogins = strtoul (optarg, NULL, 0);
+	else if (opt == 's')
+	    nstarts = strtoul (optarg, NULL, 0);
+	else if (opt == 'a')
+	    naccounts = strtoul (optarg, NULL, 0);
+	else if (opt == 'd')
+	    authdelay = strtoul (optarg, NULL, 0);
+	else
+	    BenchUsage (c_Usage);
+    }
+    if (argc != optind+2 || !naccounts)
+	BenchUsage (c_Usage);
+    char loginx [PATH_MAX], module [PATH_MAX], self [PATH_MAX];
+    if (!realpath (argv[optind], loginx) || !realpath (argv[optind+1], module) || !realpath ("/proc/self/exe", self))
+	BenchError ("realpath");
+    _loginx = loginx;
+
+    const char* scratch = BenchNamespace();
+    char shell [PATH_MAX];
+    snprintf (shell, sizeof(shell), "%s/loginbench", scratch);
+    CopyShell (self, shell);
+    BenchWritePasswd (naccounts, 1, shell);
+    WritePamConfig (scratch, module, authdelay);
+
+    // The slave is kept open here, so the master does not see a hangup
+    // when loginx closes the tty between sessions.
+    _ptm = OpenPty();
+    char ptspath [PATH_MAX];
+    snprintf (ptspath, sizeof(ptspath), "/dev/%s", _ptsname);
+    int pts = open (ptspath, O_RDWR| O_NOCTTY| O_CLOEXEC);
+    if (pts < 0)
+	BenchError (ptspath);
+    signal (SIGPIPE, SIG_IGN);
+
+    printf ("%u logins of %u accounts, auth delay %u us, on %s\n", nlogins, naccounts, authdelay, _ptsname);
+    fflush (stdout);
+
+    // Cold starts, which also fill the account cache
+    uint64_t* prompt = (uint64_t*) calloc (nstarts, sizeof(uint64_t));
+    if (!prompt)
+	BenchError ("calloc");
+    for (unsigned i = 0; i < nstarts; ++i) {
+	uint64_t t0 = BenchNow();
+	pid_t pid = StartLoginx();
+	Expect (PASSWORD_PROMPT);
+	prompt[i] = BenchNow() - t0;
+	StopLoginx (pid);
+    }
+    BenchReport ("start-to-prompt", prompt, nstarts);
+    free (prompt);
+
+    const unsigned nkeys = strlen(BENCH_PASSWORD);
+    uint64_t* echo = (uint64_t*) calloc (nlogins*nkeys, sizeof(uint64_t));
+    uint64_t* enter = (uint64_t*) calloc (nlogins, sizeof(uint64_t));
+    uint64_t* logout = (uint64_t*) calloc (nlogins, sizeof(uint64_t));
+    if (!echo || !enter || !logout)
+	BenchError ("calloc");
+
+    pid_t pid = StartLoginx();
+    Expect (PASSWORD_PROMPT);
+    for (unsigned i = 0; i < nlogins; ++i) {
+	for (unsigned k = 0; k < nkeys; ++k) {
+	    const char key[2] = { BENCH_PASSWORD[k], 0 };
+	    uint64_t t0 = BenchNow();
+	    Type (key);
+	    Expect ("*");
+	    echo[i*nkeys+k] = BenchNow() - t0;
+	}
+	uint64_t t0 = BenchNow();
+	Type ("\n");
+	Expect (SHELL_MARKER);
+	enter[i] = BenchNow() - t0;
+
+	t0 = BenchNow();
+	Type ("\n");
+	Expect (PASSWORD_PROMPT);
+	logout[i] = BenchNow() - t0;
+    }
+    StopLoginx (pid);
+    close (pts);
+
+    BenchReport ("keystroke-to-echo", echo, nlogins*nkeys);
+    BenchReport ("enter-to-shell", enter, nlogins);
+    BenchReport ("logout-to-prompt", logout, nlogins);
+    free (echo);
+    free (enter);
+    free (logout);
+    return (EXIT_SUCCESS);
+}
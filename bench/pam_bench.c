@@ -0,0 +1,37 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+// A stand-in for pam_unix in the login benchmark. Any account is
+// authenticated with the password "bench", optionally after delay=us,
+// to model a slower password hash or a remote lookup.
+
+enum { DEFAULT_AUTH_DELAY = 0 };
+
+PAM_EXTERN int pam_sm_authenticate (pam_handle_t* pamh, int flags __attribute__((unused)), int argc, const char** argv)
+{
+    unsigned delay = DEFAULT_AUTH_DELAY;
+    for (int i = 0; i < argc; ++i)
+	if (!strncmp (argv[i], "delay=", strlen("delay=")))
+	    delay = strtoul (argv[i]+strlen("delay="), NULL, 0);
+
+    const char* user = NULL;
+    const char* password = NULL;
+    if (PAM_SUCCESS != pam_get_user (pamh, &user, NULL)
+	    || PAM_SUCCESS != pam_get_authtok (pamh, PAM_AUTHTOK, &password, NULL))
+	return (PAM_AUTH_ERR);
+    if (delay)
+	usleep (delay);
+    return (password && !strcmp (password, "bench") ? PAM_SUCCESS : PAM_AUTH_ERR);
+}
+
+PAM_EXTERN int pam_sm_setcred (pam_handle_t* pamh __attribute__((unused)), int flags __attribute__((unused)),
+				int argc __attribute__((unused)), const char** argv __attribute__((unused)))
+{
+    return (PAM_SUCCESS);
+}
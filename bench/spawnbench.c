@@ -0,0 +1,109 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Measures starting a program from a process with a lot of memory in
+// use, as loginx has by the time it starts the shell. The original
+// LaunchShell used fork, which copies the page tables and write-protects
+// every page, so the parent then takes a fault on each page it writes.
+// LaunchShell now uses vfork, which shares the memory until exec. The
+// time to exec is measured to when the child's end of a close-on-exec
+// pipe is closed. This benchmark does not need root.
+
+//----------------------------------------------------------------------
+
+enum {
+    DEFAULT_ITERATIONS	= 200,
+    DEFAULT_MEGABYTES	= 128
+};
+
+static char* _mem = NULL;
+static size_t _memsz = 0;
+
+//----------------------------------------------------------------------
+
+static unsigned TouchMemory (void)
+{
+    struct rusage ru;
+    getrusage (RUSAGE_SELF, &ru);
+    const long faults = ru.ru_minflt;
+    const long pagesz = sysconf (_SC_PAGESIZE);
+    for (size_t i = 0; i < _memsz; i += pagesz)
+	++_mem[i];
+    getrusage (RUSAGE_SELF, &ru);
+    return (ru.ru_minflt - faults);
+}
+
+// Returns the time to exec, and adds the faults of the parent writing its memory after it
+static uint64_t Spawn (bool usevfork, uint64_t* faults)
+{
+    int p [2];
+    if (0 != pipe2 (p, O_CLOEXEC))
+	BenchError ("pipe2");
+    const uint64_t t0 = BenchNow();
+    pid_t pid = usevfork ? vfork() : fork();
+    if (!pid) {
+	execl ("/bin/true", "true", NULL);
+	_exit (EXIT_FAILURE);
+    } else if (pid < 0)
+	BenchError ("fork");
+    close (p[1]);
+    char c;
+    while (0 > read (p[0], &c, sizeof(c)) && errno == EINTR) {}
+    const uint64_t ns = BenchNow() - t0;
+    close (p[0]);
+
+    *faults += TouchMemory();
+    int status = 0;
+    while (0 > waitpid (pid, &status, 0))
+	if (errno != EINTR)
+	    BenchError ("waitpid");
+    return (ns);
+}
+
+static void Measure (const char* name, bool usevfork, unsigned n)
+{
+    uint64_t* ns = (uint64_t*) calloc (n, sizeof(uint64_t));
+    if (!ns)
+	BenchError ("calloc");
+    uint64_t faults = 0;
+    for (unsigned i = 0; i < n; ++i)
+	ns[i] = Spawn (usevfork, &faults);
+    BenchReport (name, ns, n);
+    printf ("%-24s %lu page faults in the parent after each\n", "", (unsigned long)(faults/n));
+    free (ns);
+}
+
+int main (int argc, char* const* argv)
+{
+    static const char c_Usage[] = "spawnbench [-n iterations] [-m megabytes]";
+    unsigned niters = DEFAULT_ITERATIONS, mbytes = DEFAULT_MEGABYTES;
+    for (int opt; 0 < (opt = getopt (argc, argv, "n:m:"));) {
+	if (opt == 'n')
+	    niters = strtoul (optarg, NULL, 0);
+	else if (opt == 'm')
+	    mbytes = strtoul (optarg, NULL, 0);
+	else
+	    BenchUsage (c_Usage);
+    }
+    if (argc != optind || !niters)
+	BenchUsage (c_Usage);
+
+    _memsz = (size_t) mbytes << 20;
+    _mem = (char*) mmap (NULL, _memsz, PROT_READ| PROT_WRITE, MAP_PRIVATE| MAP_ANONYMOUS, -1, 0);
+    if (_mem == MAP_FAILED)
+	BenchError ("mmap");
+    memset (_mem, 1, _memsz);
+    printf ("Starting /bin/true from a process with %u MB in use\n", mbytes);
+
+    Measure ("fork", false, niters);
+    Measure ("vfork", true, niters);
+    return (EXIT_SUCCESS);
+}
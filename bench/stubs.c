@@ -0,0 +1,100 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../defs.h"
+
+//----------------------------------------------------------------------
+// Globals and utility functions of loginx.c, for linking its other
+// objects into the microbenchmarks. Allocations are counted, and the
+// duration and allocations of each traced phase are kept for BenchPhase.
+
+const char* _termname = "linux";
+char _ttypath [16] = "/dev/tty63";
+bool _tracing = true;
+unsigned _benchallocs = 0;
+
+void* xmalloc (size_t n)
+{
+    __atomic_add_fetch (&_benchallocs, 1, __ATOMIC_RELAXED);
+    void* p = calloc (1, n);
+    if (!p)
+	BenchError ("xmalloc");
+    return (p);
+}
+
+void* xrealloc (void* p, size_t n)
+{
+    __atomic_add_fetch (&_benchallocs, 1, __ATOMIC_RELAXED);
+    p = realloc (p, n);
+    if (!p)
+	BenchError ("xrealloc");
+    return (p);
+}
+
+void xfree (void* p)
+{
+    free (p);
+}
+
+void ExitWithError (const char* fn)
+{
+    BenchError (fn);
+}
+
+void ExitWithMessage (const char* msg)
+{
+    fprintf (stderr, "Error: %s\n", msg);
+    exit (EXIT_FAILURE);
+}
+
+//----------------------------------------------------------------------
+
+enum { MAX_BENCH_PHASES = 16 };
+
+static struct {
+    const char*	name;
+    uint64_t	begin;
+    uint64_t	duration;
+    unsigned	allocs;
+} _phases [MAX_BENCH_PHASES];
+
+unsigned TraceBegin (const char* phase)
+{
+    unsigned t = 0;
+    while (t < MAX_BENCH_PHASES && _phases[t].name && strcmp (_phases[t].name, phase))
+	++t;
+    if (t < MAX_BENCH_PHASES) {
+	_phases[t].name = phase;
+	_phases[t].begin = BenchNow();
+	_phases[t].allocs = _benchallocs;
+    }
+    return (t);
+}
+
+void TraceEnd (unsigned t)
+{
+    if (t < MAX_BENCH_PHASES) {
+	_phases[t].duration = BenchNow() - _phases[t].begin;
+	_phases[t].allocs = _benchallocs - _phases[t].allocs;
+    }
+}
+
+void TraceFlush (void)
+{
+}
+
+// Returns the last duration of the named phase in ns, and the allocations made in it
+uint64_t BenchPhase (const char* name, unsigned* allocs)
+{
+    for (unsigned t = 0; t < MAX_BENCH_PHASES && _phases[t].name; ++t) {
+	if (!strcmp (_phases[t].name, name)) {
+	    if (allocs)
+		*allocs = _phases[t].allocs;
+	    return (_phases[t].duration);
+	}
+    }
+    return (0);
+}
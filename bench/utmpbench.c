@@ -0,0 +1,115 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "bench.h"
+#include "../defs.h"
+#include <fcntl.h>
+#include <utmp.h>
+#include <sys/time.h>
+
+// Measures the utmp writes of a session, on a terminal server with
+// thousands of other sessions in utmp. A session writes LOGIN_PROCESS,
+// USER_PROCESS, and DEAD_PROCESS twice. The baseline is the original
+// writer, which searched the file with pututline on each write. It is
+// compared with WriteUtmp of uacct.c, which finds the record once.
+
+//----------------------------------------------------------------------
+
+enum {
+    DEFAULT_SESSIONS	= 1000,
+    DEFAULT_ENTRIES	= 5000
+};
+
+static void WriteOtherSessions (unsigned n)
+{
+    int fd = open (_PATH_UTMP, O_WRONLY| O_CREAT| O_TRUNC| O_CLOEXEC, 0644);
+    if (fd < 0)
+	BenchError (_PATH_UTMP);
+    struct utmp ut;
+    memset (&ut, 0, sizeof(ut));
+    ut.ut_type = USER_PROCESS;
+    for (unsigned i = 0; i < n; ++i) {
+	ut.ut_pid = 2+i;
+	snprintf (ut.ut_line, sizeof(ut.ut_line), "pts/%u", i);
+	memcpy (ut.ut_id, &i, sizeof(ut.ut_id));	// ut_id is not a 0-terminated string
+	snprintf (ut.ut_user, sizeof(ut.ut_user), "bench%u", i);
+	if (sizeof(ut) != write (fd, &ut, sizeof(ut)))
+	    BenchError ("write utmp");
+    }
+    close (fd);
+}
+
+static void PututlineWriteUtmp (const struct account* acct, pid_t pid, short uttype)
+{
+    struct utmp ut;
+    memset (&ut, 0, sizeof(ut));
+    ut.ut_type = uttype;
+    ut.ut_pid = pid;
+    const char* ttydev = strrchr(_ttypath, '/');
+    if (!ttydev++)
+	ttydev = _ttypath;
+    strncpy (ut.ut_line, ttydev, sizeof(ut.ut_line)-1);
+    strncpy (ut.ut_id, ttydev, sizeof(ut.ut_id));	// ut_id is not a 0-terminated string
+    strncpy (ut.ut_user, acct->name, sizeof(ut.ut_user)-1);
+    gethostname (ut.ut_host, sizeof(ut.ut_host)-1);
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    ut.ut_tv.tv_sec = tv.tv_sec;
+    ut.ut_tv.tv_usec = tv.tv_usec;
+
+    if (0 != utmpname (_PATH_UTMP))
+	BenchError ("utmpname");
+    setutent();
+    if (!pututline (&ut))
+	BenchError ("pututline");
+    endutent();
+
+    if (ut.ut_type != DEAD_PROCESS)
+	updwtmp (_PATH_WTMP, &ut);
+}
+
+static void Measure (const char* name, void (*writeutmp)(const struct account*, pid_t, short), unsigned n)
+{
+    uint64_t* ns = (uint64_t*) calloc (n, sizeof(uint64_t));
+    if (!ns)
+	BenchError ("calloc");
+    static const struct account c_Acct = { .uid = BENCH_FIRST_UID, .gid = BENCH_FIRST_UID, .name = "bench" };
+    const pid_t pid = getpid();
+    for (unsigned i = 0; i < n; ++i) {
+	const pid_t shellpid = pid+1+i;
+	const uint64_t t0 = BenchNow();
+	writeutmp (&c_Acct, pid, LOGIN_PROCESS);
+	writeutmp (&c_Acct, shellpid, USER_PROCESS);
+	writeutmp (&c_Acct, shellpid, DEAD_PROCESS);
+	writeutmp (&c_Acct, pid, DEAD_PROCESS);
+	ns[i] = BenchNow() - t0;
+    }
+    BenchReport (name, ns, n);
+    free (ns);
+}
+
+int main (int argc, char* const* argv)
+{
+    static const char c_Usage[] = "utmpbench [-n sessions] [-e entries]";
+    unsigned nsessions = DEFAULT_SESSIONS, nentries = DEFAULT_ENTRIES;
+    for (int opt; 0 < (opt = getopt (argc, argv, "n:e:"));) {
+	if (opt == 'n')
+	    nsessions = strtoul (optarg, NULL, 0);
+	else if (opt == 'e')
+	    nentries = strtoul (optarg, NULL, 0);
+	else
+	    BenchUsage (c_Usage);
+    }
+    if (argc != optind || !nsessions)
+	BenchUsage (c_Usage);
+
+    BenchNamespace();
+    printf ("Writing utmp records of %u sessions on %s, with %u other sessions in utmp\n", nsessions, _ttypath, nentries);
+    WriteOtherSessions (nentries);
+    Measure ("pututline", PututlineWriteUtmp, nsessions);
+    WriteOtherSessions (nentries);
+    Measure ("indexed-slot", WriteUtmp, nsessions);
+    return (EXIT_SUCCESS);
+}
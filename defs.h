@@ -27,37 +27,80 @@ struct account {
     char*	shell;
 };
 
-typedef const struct account* const* acclist_t;
+typedef const struct account* acclist_t;
+
+// Found accounts, taken in most recently used order by RecentAccounts
+struct recentiter {
+    struct recentrange*	r;	// Pending ranges of the name index
+    unsigned		nr;
+    unsigned		cap;
+    unsigned		nlast;	// While loading, only the last user
+};
 
 extern gid_t _ttygroup;
 extern const char* _termname;
 extern char _ttypath [16];
+extern bool _tracing;
 
 //----------------------------------------------------------------------
 
 // loginx.c
 void* xmalloc (size_t n);
+void* xrealloc (void* p, size_t n);
 void xfree (void* p);
 #define xfreenull(pp)	do { xfree(pp); pp = NULL; } while(0)
 void ExitWithError (const char* fn) __attribute__((noreturn));
 void ExitWithMessage (const char* msg) __attribute__((noreturn));
+unsigned TraceBegin (const char* phase);
+void TraceEnd (unsigned t);
+void TraceFlush (void);
+bool NextTTYSpeed (void);
+void RestoreTTYSpeed (void);
 
 // pam.c
+void PamPreload (void);
 void PamOpen (void);
+bool PamSetUser (const char* name);
 void PamClose (void);
-bool PamLogin (const struct account* acct, const char* password);
+int PamLogin (const struct account* acct, const char* password);
+bool PamLoginResult (void);
+bool PamAuthFailed (void);
+void PamLoginCanceled (void);
+bool PamAutologin (const struct account* acct);
 void PamLogout (void);
 
 // uacct.c
-acclist_t ReadAccounts (void);
+int LoadAccounts (bool rebuild);
+const struct account* AutologinAccount (const char* name);
+void AccountsLoaded (void);
+void AccountLoggedOut (const struct account* acct);
+void RefreshAccounts (void);
+acclist_t Accounts (void);
 unsigned NAccounts (void);
-void ReadLastlog (void);
+unsigned FindAccounts (const char* prefix, unsigned* first);
+void StartRecentAccounts (unsigned first, unsigned n, struct recentiter* it);
+unsigned RecentAccounts (struct recentiter* it, unsigned k, unsigned* ali);
+void EndRecentAccounts (struct recentiter* it);
 void WriteLastlog (const struct account* acct);
 void WriteUtmp (const struct account* acct, pid_t pid, short uttype);
+bool ReplaceFile (const char* path, const void* buf, size_t sz);
+void WriteCacheFile (const char* path, const void* buf, size_t sz);
+void ResolveGroups (const char* name, uid_t uid, gid_t gid);
+void SetAccountGroups (const struct account* acct);
+
+// metrics.c
+struct rusage;
+void MetricsLoginStart (void);
+void MetricsLoginResult (bool ok);
+void MetricsSessionStart (void);
+void MetricsSessionChild (int status, const struct rusage* ru, bool shell);
+void MetricsSessionEnd (void);
 
 // ui.c
-unsigned LoginBox (acclist_t al, char* password);
+const struct account* LoginBox (int loadfd);
 void ClearScreen (void);
 
 // usess.c
-void RunSession (const struct account* acct);
+bool RunSession (const struct account* acct);
+void UpdateMotd (void);
+void PrefetchSession (const struct account* acct);
@@ -13,18 +13,34 @@
 #include <sys/kd.h>
 #include <fcntl.h>
 #include <utmp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 
 //----------------------------------------------------------------------
 
+static void TraceInit (void);
 static void InitEnvironment (void);
+static void SetTTY (const char* ttyname);
+static void SetTTYSpeeds (const char* speeds);
 static int  OpenTTYFd (void);
 static void OpenTTY (void);
 static void ResetTerminal (void);
+static int  Login (bool rebuildcache);
+static int  RunDaemon (unsigned nttys, const char* const* ttys, bool rebuildcache);
 
 //----------------------------------------------------------------------
 
 const char* _termname = "linux";
 char _ttypath [16];
+bool _tracing = false;
+static bool _persistent = false;	// Return to the login box after logout
+static const char* _autologin = NULL;	// Account to log in without the login box
+
+enum { MAX_TTY_SPEEDS = 8 };
+static speed_t _ttyspeeds [MAX_TTY_SPEEDS] = { B38400 };
+static unsigned _nttyspeeds = 1;
+static unsigned _ttyspeed = 0;	// Index of the current speed in _ttyspeeds
 
 //{{{ Signal handling --------------------------------------------------
 
@@ -69,6 +85,16 @@ void* xmalloc (size_t n)
     return (p);
 }
 
+void* xrealloc (void* p, size_t n)
+{
+    p = realloc (p, n);
+    if (!p) {
+	puts ("Error: out of memory");
+	exit (EXIT_FAILURE);
+    }
+    return (p);
+}
+
 void xfree (void* p)
 {
     if (p)
@@ -87,6 +113,72 @@ void ExitWithMessage (const char* msg)
     exit (EXIT_FAILURE);
 }
 
+//}}}-------------------------------------------------------------------
+//{{{ Tracing
+
+// With -t, the start and duration of each phase of startup and login is
+// recorded, and all of them are written to syslog as one message when
+// the shell is started or loginx exits. Phases may be recorded by the
+// account loader thread, so the slots are taken atomically.
+
+enum { MAX_TRACE_PHASES = 32 };
+
+static struct {
+    const char*		name;
+    struct timespec	begin;
+    struct timespec	end;
+} _trace [MAX_TRACE_PHASES];
+static unsigned _ntrace = 0;
+static struct timespec _tracet0;
+
+static void TraceInit (void)
+{
+    if (!_tracing)
+	atexit (TraceFlush);
+    _tracing = true;
+    _ntrace = 0;
+    clock_gettime (CLOCK_MONOTONIC, &_tracet0);
+}
+
+unsigned TraceBegin (const char* phase)
+{
+    if (!_tracing)
+	return (MAX_TRACE_PHASES);
+    unsigned t = __atomic_fetch_add (&_ntrace, 1, __ATOMIC_RELAXED);
+    if (t >= MAX_TRACE_PHASES)
+	return (MAX_TRACE_PHASES);
+    _trace[t].name = phase;
+    _trace[t].end.tv_sec = _trace[t].end.tv_nsec = 0;
+    clock_gettime (CLOCK_MONOTONIC, &_trace[t].begin);
+    return (t);
+}
+
+void TraceEnd (unsigned t)
+{
+    if (t < MAX_TRACE_PHASES)
+	clock_gettime (CLOCK_MONOTONIC, &_trace[t].end);
+}
+
+// Writes "phase=start+duration" for each phase, in ms since startup
+void TraceFlush (void)
+{
+    unsigned n = __atomic_exchange_n (&_ntrace, 0, __ATOMIC_RELAXED);
+    if (!_tracing || !n)
+	return;
+    #define TS_MS(t)	((t).tv_sec*1e3 + (t).tv_nsec/1e6)
+    char buf [MAX_TRACE_PHASES*48];
+    unsigned bl = 0;
+    for (unsigned i = 0; i < n && i < MAX_TRACE_PHASES && bl < sizeof(buf); ++i) {
+	const double b = TS_MS(_trace[i].begin) - TS_MS(_tracet0);
+	if (_trace[i].end.tv_sec)	// Unfinished phases have no duration
+	    bl += snprintf (buf+bl, sizeof(buf)-bl, " %s=%.3f+%.3f", _trace[i].name, b, TS_MS(_trace[i].end) - TS_MS(_trace[i].begin));
+	else
+	    bl += snprintf (buf+bl, sizeof(buf)-bl, " %s=%.3f", _trace[i].name, b);
+    }
+    #undef TS_MS
+    syslog (LOG_INFO, "trace %s:%s", _ttypath, buf);
+}
+
 //}}}-------------------------------------------------------------------
 
 int main (int argc, const char* const* argv)
@@ -95,41 +187,292 @@ int main (int argc, const char* const* argv)
 
     openlog (LOGINX_NAME, LOG_ODELAY, LOG_AUTHPRIV);
 
-    const char* ttyname = (argc > 1 ? argv[1] : "tty1");
-    snprintf (_ttypath, sizeof(_ttypath), _PATH_DEV "%s", ttyname);
-    if (argc > 3)
-	_termname = argv[3];
+    bool rebuildcache = false, daemonmode = false;
+    for (int opt; 0 < (opt = getopt (argc, (char* const*) argv, "a:mprt"));) {
+	if (opt == 'a')
+	    _autologin = optarg;
+	else if (opt == 'm')
+	    daemonmode = true;
+	else if (opt == 'p')
+	    _persistent = true;
+	else if (opt == 'r')
+	    rebuildcache = true;
+	else if (opt == 't')
+	    TraceInit();
+	else
+	    ExitWithMessage ("usage: " LOGINX_NAME " [-prt] [-a user] tty [speed [term]]\n"
+			     "       " LOGINX_NAME " [-prt] -m tty...");
+    }
+    argc -= optind;
+    argv += optind;
 
+    if (daemonmode) {
+	InitEnvironment();
+	return (RunDaemon (argc, argv, rebuildcache));
+    }
+    SetTTY (argc > 0 ? argv[0] : "tty1");
+    if (argc > 1)
+	SetTTYSpeeds (argv[1]);
+    if (argc > 2)
+	_termname = argv[2];
+    unsigned t = TraceBegin ("InitEnvironment");
     InitEnvironment();
+    TraceEnd (t);
+    return (Login (rebuildcache));
+}
+
+static void SetTTY (const char* ttyname)
+{
+    snprintf (_ttypath, sizeof(_ttypath), _PATH_DEV "%s", ttyname);
+}
+
+// Parses a comma-separated list of line speeds, as in 115200,38400,9600
+static void SetTTYSpeeds (const char* speeds)
+{
+    static const struct { unsigned baud; speed_t speed; } c_Speeds[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+	{ 921600, B921600 }
+    };
+    _nttyspeeds = 0;
+    for (const char* s = speeds; *s && _nttyspeeds < MAX_TTY_SPEEDS; s += !!*s) {
+	char* send = NULL;
+	unsigned long baud = strtoul (s, &send, 10);
+	unsigned i = 0;
+	while (i < sizeof(c_Speeds)/sizeof(c_Speeds[0]) && c_Speeds[i].baud != baud)
+	    ++i;
+	if (send == s || (*send && *send != ',') || i >= sizeof(c_Speeds)/sizeof(c_Speeds[0]))
+	    ExitWithMessage ("invalid tty speed");
+	_ttyspeeds[_nttyspeeds++] = c_Speeds[i].speed;
+	s = send;
+    }
+    if (!_nttyspeeds)
+	ExitWithMessage ("invalid tty speed");
+}
+
+static bool SetTTYSpeed (int when)
+{
+    struct termios ti;
+    if (0 > tcgetattr (STDIN_FILENO, &ti))
+	return (false);
+    cfsetispeed (&ti, _ttyspeeds[_ttyspeed]);
+    cfsetospeed (&ti, _ttyspeeds[_ttyspeed]);
+    return (0 == tcsetattr (STDIN_FILENO, when, &ti));
+}
+
+// Switches to the next line speed, when the user sends a break
+bool NextTTYSpeed (void)
+{
+    if (_nttyspeeds < 2)
+	return (false);
+    _ttyspeed = (_ttyspeed+1) % _nttyspeeds;
+    return (SetTTYSpeed (TCSAFLUSH));
+}
+
+// Reapplies the selected line speed, after endwin restored the one curses started with
+void RestoreTTYSpeed (void)
+{
+    if (_nttyspeeds > 1)
+	SetTTYSpeed (TCSADRAIN);
+}
+
+// Runs one login session on _ttypath, or, in persistent mode, one after another
+static int Login (bool rebuildcache)
+{
+    const char* ttyname = _ttypath + strlen(_PATH_DEV);
+    unsigned t = TraceBegin ("OpenTTY");
     OpenTTY();
+    TraceEnd (t);
+    t = TraceBegin ("ResetTerminal");
     ResetTerminal();
-    acclist_t al = ReadAccounts();
-    ReadLastlog();
+    TraceEnd (t);
+    // Autologin resolves only its account, and needs neither the account list nor the login box
+    int loadfd = _autologin ? -1 : LoadAccounts (rebuildcache);
+
+    for (;;) {
+	UpdateMotd();
+
+	const struct account* acct = NULL;
+	if (_autologin) {
+	    t = TraceBegin ("Autologin");
+	    if (!(acct = AutologinAccount (_autologin)) || !PamAutologin (acct)) {
+		syslog (LOG_ERR, "autologin of %s failed", _autologin);
+		_autologin = NULL;	// Fall back to the login box
+		acct = NULL;
+		loadfd = LoadAccounts (rebuildcache);
+	    }
+	    TraceEnd (t);
+	}
+	if (!acct) {
+	    PamPreload();
+	    acct = LoginBox (loadfd);
+	}
+
+	t = TraceBegin ("WriteLastlog");
+	WriteLastlog (acct);
+	TraceEnd (t);
+	t = TraceBegin ("WriteUtmp");
+	WriteUtmp (acct, getpid(), LOGIN_PROCESS);
+	TraceEnd (t);
+	if (!acct->uid)	// The login strings are copied from util-linux login to allow log grepping compatibility
+	    syslog (LOG_NOTICE, "ROOT LOGIN ON %s", ttyname);
+	else
+	    syslog (LOG_INFO, "LOGIN ON %s BY %s", ttyname, acct->name);
+
+	const bool loggedout = RunSession (acct);
+
+	WriteUtmp (acct, getpid(), DEAD_PROCESS);
+	PamLogout();
+	PamClose();
+	if (!_persistent || !loggedout) {	// A signal to end the session is also one to exit
+	    ResetTerminal();
+	    break;
+	}
+
+	// Processes outside the session, like user services, or those
+	// EndSession gave up on, may still have the tty open, and would
+	// read the next user's password. So the tty is hung up and reopened,
+	// as when loginx is respawned. The account list is kept, and reread
+	// only if its sources changed. PAM is restarted in the background,
+	// because a handle is not reusable for another user's session.
+	if (_tracing)
+	    TraceInit();
+	for (unsigned f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+	    close (f);
+	t = TraceBegin ("OpenTTY");
+	OpenTTY();
+	TraceEnd (t);
+	ResetTerminal();
+	if (!_autologin) {	// Autologin will log in the same account again
+	    t = TraceBegin ("RefreshAccounts");
+	    AccountLoggedOut (acct);
+	    AccountsLoaded();
+	    loadfd = -1;
+	    RefreshAccounts();
+	    TraceEnd (t);
+	}
+    }
+    return (EXIT_SUCCESS);
+}
 
-    char password [MAX_PW_LEN];
-    unsigned ali = LoginBox (al, password);
+//{{{ Daemon mode ------------------------------------------------------
+
+// In daemon mode one process supervises several ttys. The account list
+// and the PAM handle are loaded once, and a process is forked for each
+// tty to run the login box and the session, so the loading is not repeated
+// per tty. This is only a shared preload: the login boxes are not driven
+// from the daemon loop, because the ui, pam, and session code assume the
+// tty is stdin. So each idle tty still has its own curses state, and the
+// pages of its PAM handle and account list become private as they are
+// written. Each tty process that exits is replaced, after a delay if it
+// exits too fast.
+
+enum { DAEMON_RESPAWN_DELAY = 1 };
+
+struct ttyproc {
+    const char*	name;
+    pid_t	pid;
+    time_t	started;
+};
+
+static pid_t SpawnTTY (const char* ttyname, const sigset_t* omask, bool rebuildcache)
+{
+    RefreshAccounts();
+    pid_t pid = fork();
+    if (pid) {
+	if (pid < 0)
+	    syslog (LOG_ERR, "fork: %m");
+	return (pid > 0 ? pid : 0);
+    }
+    // Tty process: drop everything belonging to the daemon loop and proceed as a normal loginx
+    sigprocmask (SIG_SETMASK, omask, NULL);
+    if (_tracing)
+	TraceInit();
+    InstallCleanupHandlers();
+    for (unsigned f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+	close (f);
+    if (setsid() < 0)
+	ExitWithError ("setsid");
+    SetTTY (ttyname);
+    exit (Login (rebuildcache));
+}
+
+static int RunDaemon (unsigned nttys, const char* const* ttys, bool rebuildcache)
+{
+    if (!nttys)
+	ExitWithMessage ("no ttys given");
+
+    // Keep the standard fds occupied, so that daemon fds are never inherited as tty fds
+    for (unsigned f = STDIN_FILENO; f <= STDERR_FILENO; ++f)
+	if (f != (unsigned) open (_PATH_DEVNULL, O_RDWR))
+	    ExitWithError ("open " _PATH_DEVNULL);
+
+    // Signals are handled in the loop; the tty processes restore the mask
+    sigset_t smask, omask;
+    sigemptyset (&smask);
+    sigaddset (&smask, SIGCHLD);
+    sigaddset (&smask, SIGTERM);
+    sigaddset (&smask, SIGINT);
+    sigaddset (&smask, SIGHUP);
+    sigprocmask (SIG_BLOCK, &smask, &omask);
+    int sfd = signalfd (-1, &smask, SFD_NONBLOCK| SFD_CLOEXEC);
+    int efd = epoll_create1 (EPOLL_CLOEXEC);
+    struct epoll_event ev = { EPOLLIN, { .fd = sfd } };
+    if (sfd < 0 || efd < 0 || 0 != epoll_ctl (efd, EPOLL_CTL_ADD, sfd, &ev))
+	ExitWithError ("signalfd");
+
+    // Load everything the tty processes can share
+    LoadAccounts (rebuildcache);
+    AccountsLoaded();
     PamOpen();
-    bool loginok = PamLogin (al[ali], password);
-    memset (password, 0, sizeof(password));
-    if (!loginok)
-	return (EXIT_FAILURE);
-
-    WriteLastlog (al[ali]);
-    WriteUtmp (al[ali], getpid(), LOGIN_PROCESS);
-    if (!al[ali]->uid)	// The login strings are copied from util-linux login to allow log grepping compatibility
-	syslog (LOG_NOTICE, "ROOT LOGIN ON %s", ttyname);
-    else
-	syslog (LOG_INFO, "LOGIN ON %s BY %s", ttyname, al[ali]->name);
-
-    RunSession (al[ali]);
-
-    WriteUtmp (al[ali], getpid(), DEAD_PROCESS);
-    PamLogout();
-    PamClose();
-    ResetTerminal();
+
+    struct ttyproc* tp = (struct ttyproc*) xmalloc (nttys*sizeof(struct ttyproc));
+    for (unsigned i = 0; i < nttys; ++i)
+	tp[i].name = ttys[i];
+
+    for (bool quitting = false; !quitting;) {
+	int timeout = -1;
+	const time_t now = time (NULL);
+	for (unsigned i = 0; i < nttys; ++i) {
+	    if (tp[i].pid)
+		continue;
+	    if (now >= tp[i].started + DAEMON_RESPAWN_DELAY) {
+		tp[i].started = now;
+		tp[i].pid = SpawnTTY (tp[i].name, &omask, rebuildcache);
+	    } else
+		timeout = DAEMON_RESPAWN_DELAY*1000;
+	}
+	if (0 > epoll_wait (efd, &ev, 1, timeout)) {
+	    if (errno == EINTR)
+		continue;
+	    ExitWithError ("epoll_wait");
+	}
+	struct signalfd_siginfo si;
+	while (sizeof(si) == read (sfd, &si, sizeof(si))) {
+	    if (si.ssi_signo != SIGCHLD) {
+		syslog (LOG_INFO, "shutting down on signal %u", si.ssi_signo);
+		quitting = true;
+	    }
+	}
+	for (pid_t pid; 0 < (pid = waitpid (-1, NULL, WNOHANG));)
+	    for (unsigned i = 0; i < nttys; ++i)
+		if (tp[i].pid == pid)
+		    tp[i].pid = 0;
+    }
+
+    for (unsigned i = 0; i < nttys; ++i)
+	if (tp[i].pid)
+	    kill (tp[i].pid, SIGTERM);
+    while (0 < wait (NULL)) {}
+    xfree (tp);
+    close (efd);
+    close (sfd);
     return (EXIT_SUCCESS);
 }
 
+//}}}-------------------------------------------------------------------
+
 static void InitEnvironment (void)
 {
     for (unsigned f = 0, fend = getdtablesize(); f < fend; ++f)
@@ -204,8 +547,12 @@ static void ResetTerminal (void)
 	ExitWithError ("tcgetattr");
     // Overwrite known fields with sane defaults
     ti.c_iflag = ICRNL| IXON| BRKINT| IUTF8;
+    if (_nttyspeeds > 1)	// With several speeds a break selects the next one, so it must be read as a NUL
+	ti.c_iflag &= ~BRKINT;
     ti.c_oflag = ONLCR| OPOST;
-    ti.c_cflag = HUPCL| CREAD| CS8| B38400;
+    ti.c_cflag = HUPCL| CREAD| CS8;
+    cfsetispeed (&ti, _ttyspeeds[_ttyspeed]);
+    cfsetospeed (&ti, _ttyspeeds[_ttyspeed]);
     ti.c_lflag = ISIG| ICANON| ECHO| ECHOE| ECHOK| ECHOCTL| ECHOKE| IEXTEN;
     #define TCTRL(k) k-('A'-1)
     static const cc_t c_CtrlChar[NCCS] = {
@@ -0,0 +1,176 @@
+// This file is part of the loginx project
+//
+// Copyright (c) 2013 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "defs.h"
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Login and session metrics of each tty are kept in a file in the
+// Prometheus text format, for the node exporter textfile collector. The
+// file is replaced after each session and failed login; the counters in
+// it are read back on first use, to continue across restarts.
+
+//----------------------------------------------------------------------
+
+enum {
+    M_LOGINS,
+    M_FAILED_LOGINS,
+    M_SESSION_SECONDS,
+    M_LAST_LOGIN_TIME,
+    M_LAST_AUTH,
+    M_LAST_EXEC_LATENCY,
+    M_LAST_SESSION_LENGTH,
+    M_LAST_EXIT_STATUS,
+    M_LAST_CPU_USER,
+    M_LAST_CPU_SYSTEM,
+    M_LAST_MAX_RSS,
+    M_LAST_BLOCK_IN,
+    M_LAST_BLOCK_OUT,
+    NMETRICS
+};
+
+static const struct {
+    const char*	name;
+    const char*	type;
+    const char*	help;
+} c_Metrics [NMETRICS] = {
+    { "loginx_logins_total",		  "counter", "Successful logins" },
+    { "loginx_failed_logins_total",	  "counter", "Failed login attempts" },
+    { "loginx_session_seconds_total",	  "counter", "Time spent in sessions" },
+    { "loginx_last_login_timestamp_seconds", "gauge", "When the last session started" },
+    { "loginx_last_auth_seconds",	  "gauge", "Time PAM took to log in the last user" },
+    { "loginx_last_exec_latency_seconds", "gauge", "Time from password entry to shell exec in the last session" },
+    { "loginx_last_session_seconds",	  "gauge", "Length of the last session" },
+    { "loginx_last_exit_status",	  "gauge", "Exit status of the last session shell, 128+signal if killed" },
+    { "loginx_last_cpu_user_seconds",	  "gauge", "User CPU time of all processes of the last session" },
+    { "loginx_last_cpu_system_seconds",	  "gauge", "System CPU time of all processes of the last session" },
+    { "loginx_last_max_rss_bytes",	  "gauge", "Largest resident set of a process of the last session" },
+    { "loginx_last_block_input_ops",	  "gauge", "Filesystem block reads of all processes of the last session" },
+    { "loginx_last_block_output_ops",	  "gauge", "Filesystem block writes of all processes of the last session" }
+};
+
+static double _metrics [NMETRICS];
+static bool _metricsread = false;
+static struct timespec _loginstart;	// When the password was entered
+static struct timespec _sessionstart;	// When the shell was exec'ed
+static struct rusage _sessionru;	// Summed over the reaped session processes
+static int _shellstatus = 0;
+
+//----------------------------------------------------------------------
+
+static double SecondsSince (const struct timespec* t)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec)/1e9);
+}
+
+static void MetricsPath (char* path, size_t pathsz)
+{
+    // The file is named after the tty, as in tty1.prom or pts-0.prom
+    snprintf (path, pathsz, PATH_METRICS_DIR "/%s.prom", _ttypath+strlen(_PATH_DEV));
+    for (char* p = path+sizeof(PATH_METRICS_DIR); *p; ++p)
+	if (*p == '/')
+	    *p = '-';
+}
+
+static void ReadMetrics (void)
+{
+    _metricsread = true;
+    char path [PATH_MAX];
+    MetricsPath (path, sizeof(path));
+    FILE* f = fopen (path, "re");
+    if (!f)
+	return;
+    char line [256], name [64];
+    double v;
+    while (fgets (line, sizeof(line), f))
+	if (line[0] != '#' && 2 == sscanf (line, "%63[a-z_]{%*[^}]} %lf", name, &v))
+	    for (unsigned i = 0; i < NMETRICS; ++i)
+		if (0 == strcmp (name, c_Metrics[i].name))
+		    _metrics[i] = v;
+    fclose (f);
+}
+
+static void WriteMetrics (void)
+{
+    if (!_metricsread)
+	ReadMetrics();
+    char path [PATH_MAX];
+    MetricsPath (path, sizeof(path));
+    if ((0 != mkdir (PATH_LOGINX_STATE, 0755) && errno != EEXIST) || (0 != mkdir (PATH_METRICS_DIR, 0755) && errno != EEXIST))
+	return;
+    const char* tty = _ttypath+strlen(_PATH_DEV);
+    char buf [NMETRICS*192];
+    unsigned bl = 0;
+    for (unsigned i = 0; i < NMETRICS && bl < sizeof(buf); ++i)
+	bl += snprintf (buf+bl, sizeof(buf)-bl, "# HELP %s %s\n# TYPE %s %s\n%s{tty=\"%s\"} %.15g\n",
+			c_Metrics[i].name, c_Metrics[i].help, c_Metrics[i].name, c_Metrics[i].type,
+			c_Metrics[i].name, tty, _metrics[i]);
+    if (bl < sizeof(buf))
+	ReplaceFile (path, buf, bl);
+}
+
+//----------------------------------------------------------------------
+
+// Called when the password is entered
+void MetricsLoginStart (void)
+{
+    clock_gettime (CLOCK_MONOTONIC, &_loginstart);
+}
+
+// Called when PAM is done, with its result
+void MetricsLoginResult (bool ok)
+{
+    if (!_metricsread)
+	ReadMetrics();
+    if (ok)
+	_metrics[M_LAST_AUTH] = SecondsSince (&_loginstart);
+    else {
+	++_metrics[M_FAILED_LOGINS];
+	WriteMetrics();
+    }
+}
+
+// Called when the session shell has been exec'ed
+void MetricsSessionStart (void)
+{
+    clock_gettime (CLOCK_MONOTONIC, &_sessionstart);
+    _metrics[M_LAST_EXEC_LATENCY] = SecondsSince (&_loginstart);
+    _metrics[M_LAST_LOGIN_TIME] = time (NULL);
+    memset (&_sessionru, 0, sizeof(_sessionru));
+    _shellstatus = 0;
+}
+
+// Called with the wait4 results of each reaped session process
+void MetricsSessionChild (int status, const struct rusage* ru, bool shell)
+{
+    if (shell)
+	_shellstatus = WIFSIGNALED(status) ? 128+WTERMSIG(status) : WEXITSTATUS(status);
+    timeradd (&_sessionru.ru_utime, &ru->ru_utime, &_sessionru.ru_utime);
+    timeradd (&_sessionru.ru_stime, &ru->ru_stime, &_sessionru.ru_stime);
+    if (_sessionru.ru_maxrss < ru->ru_maxrss)
+	_sessionru.ru_maxrss = ru->ru_maxrss;
+    _sessionru.ru_inblock += ru->ru_inblock;
+    _sessionru.ru_oublock += ru->ru_oublock;
+}
+
+// Called when every process of the session has ended
+void MetricsSessionEnd (void)
+{
+    const double length = SecondsSince (&_sessionstart);
+    ++_metrics[M_LOGINS];
+    _metrics[M_SESSION_SECONDS] += length;
+    _metrics[M_LAST_SESSION_LENGTH] = length;
+    _metrics[M_LAST_EXIT_STATUS] = _shellstatus;
+    _metrics[M_LAST_CPU_USER] = _sessionru.ru_utime.tv_sec + _sessionru.ru_utime.tv_usec/1e6;
+    _metrics[M_LAST_CPU_SYSTEM] = _sessionru.ru_stime.tv_sec + _sessionru.ru_stime.tv_usec/1e6;
+    _metrics[M_LAST_MAX_RSS] = _sessionru.ru_maxrss*1024.;
+    _metrics[M_LAST_BLOCK_IN] = _sessionru.ru_inblock;
+    _metrics[M_LAST_BLOCK_OUT] = _sessionru.ru_oublock;
+    WriteMetrics();
+}
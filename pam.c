@@ -7,25 +7,46 @@
 #include <security/pam_appl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
 
 //----------------------------------------------------------------------
 
 static int xconv (int num_msg, const struct pam_message** msgm, struct pam_response** response, void* appdata_ptr);
+static int PamStart (void);
+static bool PamAuthenticate (const struct account* acct, const char* password);
+static bool PamOpenSession (const struct account* acct);
 
 //----------------------------------------------------------------------
 
 static pam_handle_t* _pamh = NULL;
+static const char* _pamservice = LOGINX_PAM_SERVICE;
 static const char* _username = NULL;
 static const char* _password = NULL;	// Used only by xconv during PamLogin
+static pthread_t _pamstarter;
+static bool _pamstarting = false;
+static bool _pamstarted = false;	// Set by the starter thread when done
+static pthread_t _authenticator;
+static bool _authenticating = false;
+static int _authfd[2] = { -1, -1 };
+static const struct account* _authacct = NULL;
+static bool _authok = false;
 
 //----------------------------------------------------------------------
 
-static void verify (int r, const char* fn)
+static bool check (int r, const char* fn)
 {
     if (r == PAM_SUCCESS)
-	return;
+	return (true);
     syslog (LOG_ERR, "%s: %s", fn, pam_strerror(_pamh,r));
-    exit (EXIT_FAILURE);
+    return (false);
+}
+
+static void verify (int r, const char* fn)
+{
+    if (!check (r, fn))
+	exit (EXIT_FAILURE);
 }
 
 static void PamSetEnvironment (void)
@@ -39,18 +60,72 @@ static void PamSetEnvironment (void)
 	pam_set_item (_pamh, PAM_TTY, tty);
 }
 
-void PamOpen (void)
+// pam_start parses the PAM configuration and loads all the modules
+static int PamStart (void)
 {
     static const struct pam_conv conv = { xconv, NULL };
-    int r = pam_start (LOGINX_NAME, NULL, &conv, &_pamh);
-    verify(r,"pam_start");
+    unsigned t = TraceBegin ("pam_start");
+    int r = pam_start (_pamservice, NULL, &conv, &_pamh);
+    TraceEnd (t);
+    return (r);
+}
+
+static void* PamStarter (void* arg __attribute__((unused)))
+{
+    intptr_t r = PamStart();
+    __atomic_store_n (&_pamstarted, true, __ATOMIC_RELEASE);
+    return ((void*) r);
+}
+
+// Starts PAM in the background while the user is typing
+void PamPreload (void)
+{
+    if (_pamh || _pamstarting)
+	return;
+    // Signals must go to the main thread, to be caught by the session signalfd
+    sigset_t all, omask;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &omask);
+    if (0 == pthread_create (&_pamstarter, NULL, PamStarter, NULL))
+	_pamstarting = true;
+    pthread_sigmask (SIG_SETMASK, &omask, NULL);
+}
+
+void PamOpen (void)
+{
+    // In daemon mode the handle is started before forking the tty process
+    if (_pamstarting || !_pamh) {
+	int r;
+	if (_pamstarting) {
+	    void* tr = NULL;
+	    pthread_join (_pamstarter, &tr);
+	    _pamstarting = false;
+	    r = (intptr_t) tr;
+	} else
+	    r = PamStart();
+	verify(r,"pam_start");
+	static bool s_AtExit = false;
+	if (!s_AtExit)
+	    atexit (PamClose);
+	s_AtExit = true;
+    }
     PamSetEnvironment();
-    atexit (PamClose);
+}
+
+// Tells PAM which user is selected, returning false if it is not started yet
+bool PamSetUser (const char* name)
+{
+    if (_pamstarting) {
+	if (!__atomic_load_n (&_pamstarted, __ATOMIC_ACQUIRE))
+	    return (false);
+	PamOpen();
+    }
+    return (_pamh && PAM_SUCCESS == pam_set_item (_pamh, PAM_USER, name));
 }
 
 void PamClose (void)
 {
-    if (!_pamh)
+    if (!_pamh || _authenticating)	// A canceled login still uses the handle, so it goes with the process
 	return;
     if (_username)
 	PamLogout();
@@ -58,34 +133,141 @@ void PamClose (void)
     _pamh = NULL;
 }
 
-bool PamLogin (const struct account* acct, const char* password)
+// Checks the password and the account. Called on the login thread.
+static bool PamAuthenticate (const struct account* acct, const char* password)
 {
     pam_set_item (_pamh, PAM_USER, acct->name);
     _password = password;	// Used only by xconv
+    unsigned t = TraceBegin ("pam_authenticate");
     int r = pam_authenticate (_pamh, PAM_SILENT| PAM_DISALLOW_NULL_AUTHTOK);
-    verify(r,"pam_authenticate");
-    r = pam_acct_mgmt (_pamh, PAM_SILENT| PAM_DISALLOW_NULL_AUTHTOK);
-    if (r == PAM_NEW_AUTHTOK_REQD) {
-	r = pam_chauthtok(_pamh,PAM_CHANGE_EXPIRED_AUTHTOK);
-	verify(r,"pam_chauthtok");
+    TraceEnd (t);
+    bool ok = check (r, "pam_authenticate");
+    if (ok) {
+	t = TraceBegin ("pam_acct_mgmt");
+	r = pam_acct_mgmt (_pamh, PAM_SILENT| PAM_DISALLOW_NULL_AUTHTOK);
+	TraceEnd (t);
+	if (r == PAM_NEW_AUTHTOK_REQD)
+	    ok = check (pam_chauthtok (_pamh, PAM_CHANGE_EXPIRED_AUTHTOK), "pam_chauthtok");
+	else
+	    ok = check (r, "pam_acct_mgmt");
     }
-    initgroups (acct->name, acct->gid);
-    verify(r,"pam_acct_mgmt");
-    r = pam_setcred(_pamh, PAM_SILENT| PAM_ESTABLISH_CRED);
-    verify(r,"pam_setcred");
+    _password = NULL;
+    return (ok);
+}
+
+// Establishes the credentials and opens the session, undoing it on failure.
+// Modules set per-thread state here, like the loginuid, the exec security
+// context, and the session keyring, so this runs on the thread that will
+// start the shell.
+static bool PamOpenSession (const struct account* acct)
+{
+    unsigned t = TraceBegin ("setgroups");
+    SetAccountGroups (acct);
+    TraceEnd (t);
+    t = TraceBegin ("pam_setcred");
+    int r = pam_setcred(_pamh, PAM_SILENT| PAM_ESTABLISH_CRED);
+    TraceEnd (t);
+    if (!check (r, "pam_setcred"))
+	return (false);
+    t = TraceBegin ("pam_open_session");
     r = pam_open_session (_pamh, PAM_SILENT);
-    verify(r,"pam_open_session");
+    TraceEnd (t);
+    if (!check (r, "pam_open_session")) {
+	pam_setcred (_pamh, PAM_SILENT| PAM_DELETE_CRED);
+	return (false);
+    }
     pam_get_item (_pamh, PAM_USER, (const void**) &_username);
-    _password = NULL;
-    if (!_username || 0 != strcmp (_username, acct->name))
+    if (!_username || 0 != strcmp (_username, acct->name)) {
+	pam_close_session (_pamh, PAM_SILENT);
+	pam_setcred (_pamh, PAM_SILENT| PAM_DELETE_CRED);
+	_username = NULL;
 	return (false);
+    }
+    return (true);
+}
+
+static void* PamAuthenticator (void* password)
+{
+    PamOpen();
+    _authok = PamAuthenticate (_authacct, (const char*) password);
+    close (_authfd[1]);
+    return (NULL);
+}
 
-    // Give ownership of the tty
+// Starts logging in acct off the UI thread. Returns an fd that is closed when done.
+int PamLogin (const struct account* acct, const char* password)
+{
+    if (0 != pipe2 (_authfd, O_CLOEXEC))
+	ExitWithError ("pipe2");
+    _authacct = acct;
+    _authok = false;
+    MetricsLoginStart();
+    _authenticating = true;
+    sigset_t all, omask;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &omask);
+    const bool started = (0 == pthread_create (&_authenticator, NULL, PamAuthenticator, (void*) password));
+    pthread_sigmask (SIG_SETMASK, &omask, NULL);
+    if (!started) {
+	_authenticating = false;
+	PamAuthenticator ((void*) password);
+    }
+    return (_authfd[0]);
+}
+
+static void GiveTTY (const struct account* acct)
+{
     fchown (STDIN_FILENO, acct->uid, _ttygroup ? _ttygroup : acct->gid);
     fchmod (STDIN_FILENO, 0620);
+}
+
+// Waits for the login started by PamLogin, and opens the session if it succeeded
+bool PamLoginResult (void)
+{
+    if (_authenticating)
+	pthread_join (_authenticator, NULL);
+    _authenticating = false;
+    close (_authfd[0]);
+    _authfd[0] = -1;
+    const bool ok = _authok && PamOpenSession (_authacct);
+    MetricsLoginResult (ok);
+    if (!ok)
+	return (false);
+    GiveTTY (_authacct);
     return (true);
 }
 
+// After PamLoginResult fails, tells if the password was rejected, rather than the session not opening
+bool PamAuthFailed (void)
+{
+    return (!_authok);
+}
+
+// Gives up on the login started by PamLogin, which a PAM module may not
+// return from. It counts as failed, and the caller must exit.
+void PamLoginCanceled (void)
+{
+    MetricsLoginResult (false);
+}
+
+// Logs in acct without a password, through the autologin PAM service.
+// On failure, PAM is left to be started again with the regular service.
+bool PamAutologin (const struct account* acct)
+{
+    PamClose();	// In daemon mode, the regular service is already started
+    _pamservice = LOGINX_AUTOLOGIN_PAM_SERVICE;
+    PamOpen();
+    MetricsLoginStart();
+    bool ok = PamAuthenticate (acct, "") && PamOpenSession (acct);
+    MetricsLoginResult (ok);
+    if (ok)
+	GiveTTY (acct);
+    else
+	PamClose();
+    _pamservice = LOGINX_PAM_SERVICE;
+    return (ok);
+}
+
 void PamLogout (void)
 {
     if (!_username)
@@ -98,6 +280,7 @@ void PamLogout (void)
     pam_close_session (_pamh, PAM_SILENT);
     pam_setcred (_pamh, PAM_SILENT| PAM_DELETE_CRED);
     _username = NULL;
+    setgroups (0, NULL);	// Drop the groups set by initgroups
 }
 
 static int xconv (int num_msg, const struct pam_message** msgm, struct pam_response** response, void* appdata_ptr __attribute__((unused)))
@@ -9,22 +9,85 @@
 #include <utmp.h>
 #include <time.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <signal.h>
 
-static struct account** _accts = NULL;
+//----------------------------------------------------------------------
+
+// The account snapshot is a header, followed by naccts records, followed
+// by a pool of 0-terminated strings referenced by offset from the records.
+struct snaphdr {
+    uint32_t	magic;
+    uint32_t	naccts;
+    uint32_t	strsz;
+    uint32_t	reserved;
+    uint64_t	taken;		// Time enumeration began, to catch changes made during it
+};
+
+struct snaprec {
+    uint32_t	uid;
+    uint32_t	gid;
+    uint32_t	ltime;
+    uint32_t	name;
+    uint32_t	dir;
+    uint32_t	shell;
+};
+
+enum { SNAPSHOT_MAGIC = 0x4c4e5832 };	// "LNX2"
+
+//----------------------------------------------------------------------
+
+static struct account* _accts = NULL;	// Flat array of records
 static unsigned _naccts = 0;
+static char* _accstrs = NULL;		// Packed strings referenced by the records
+static size_t _accstrsz = 0;
+static void* _snapshot = NULL;		// Mapped snapshot, if accounts were loaded from it
+static size_t _snapshotsz = 0;
+static struct timespec _snapshotmtime;	// Last update of the loaded snapshot, to compare with lastlog
+static time_t _taken = 0;		// Time of the NSS enumeration the list came from
 gid_t _ttygroup = 0;
 
-static void CleanupAccounts (void)
+// Until the loader thread is done, only the last user account is available
+static pthread_t _loader;
+static int _loaderfd [2] = { -1, -1 };	// Loader closes its end when done
+static bool _loading = false;
+static struct account _lastuser;
+static unsigned _nlastuser = 0;
+
+// Name index for type-ahead search, built with the list
+static unsigned* _byname = NULL;	// Account indexes sorted by name
+static unsigned* _mrutree = NULL;	// Segment tree over _byname of positions with latest ltime
+static unsigned _mruleaves = 0;
+static uint32_t _loginltime = 0;	// Of the session in progress, set in the list when it ends
+
+static void FreeAccounts (void)
 {
-    if (!_accts)
+    if (!_accts || _loading)
 	return;
-    for (unsigned i = 0; i < _naccts; ++i) {
-	xfree (_accts[i]->name);
-	xfree (_accts[i]->dir);
-	xfree (_accts[i]->shell);
-	xfree (_accts[i]);
-    }
+    if (_snapshot) {	// Strings point into the mapped snapshot
+	munmap (_snapshot, _snapshotsz);
+	_snapshot = NULL;
+    } else
+	xfree (_accstrs);
+    _accstrs = NULL;
+    _accstrsz = 0;
     xfreenull (_accts);
+    _naccts = 0;
+    xfreenull (_byname);
+    xfreenull (_mrutree);
+}
+
+static void CleanupAccounts (void)
+{
+    if (_nlastuser) {
+	xfree (_lastuser.name);
+	_nlastuser = 0;
+    }
+    FreeAccounts();
 }
 
 static bool CanLogin (const struct passwd* pw)
@@ -32,77 +95,944 @@ static bool CanLogin (const struct passwd* pw)
     return (pw->pw_shell && strcmp(pw->pw_shell, "/bin/false") && strcmp(pw->pw_shell,"/sbin/nologin"));
 }
 
-acclist_t ReadAccounts (void)
+//{{{ Account snapshot -------------------------------------------------
+
+// The snapshot is stale if it is too old or if any of the account sources changed after it was taken
+static bool SnapshotIsFresh (time_t taken)
+{
+    const time_t now = time (NULL);
+    if (taken > now || taken + ACCOUNT_CACHE_MAXAGE < now)
+	return (false);
+    static const char c_Sources[][32] = {
+	"/etc/passwd",
+	"/etc/group",
+	"/etc/nsswitch.conf",
+	"/var/lib/sss/mc/passwd",
+	"/var/cache/nscd/passwd",
+	"/var/db/nscd/passwd"
+    };
+    for (unsigned i = 0; i < sizeof(c_Sources)/sizeof(c_Sources[0]); ++i) {
+	struct stat st;
+	if (0 == stat (c_Sources[i], &st) && st.st_mtime >= taken)
+	    return (false);
+    }
+    return (true);
+}
+
+static bool LoadSnapshot (void)
 {
-    _ttygroup = getgid();
-    struct group* ttygr = getgrnam("tty");
-    if (ttygr)	// If no tty group, use user's primary group
-	_ttygroup = ttygr->gr_gid;
-    endgrent();
+    int fd = open (PATH_ACCOUNT_CACHE, O_RDONLY| O_CLOEXEC);
+    if (fd < 0)
+	return (false);
+    struct stat st;
+    if (0 != fstat (fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != 0
+	    || (size_t) st.st_size < sizeof(struct snaphdr)) {
+	close (fd);
+	return (false);
+    }
+    void* p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+	return (false);
 
-    unsigned nac = 0;
-    setpwent();
-    for (struct passwd* pw; (pw = getpwent());)
-	nac += CanLogin (pw);
-    _accts = (struct account**) xmalloc ((nac+1)*sizeof(struct account*));
-    atexit (CleanupAccounts);
-    nac = 0;
+    // Validate everything, the file may be truncated or from another version
+    const struct snaphdr* h = (const struct snaphdr*) p;
+    const struct snaprec* r = (const struct snaprec*) (h+1);
+    const char* strs = (const char*) (r + h->naccts);
+    if (h->magic != SNAPSHOT_MAGIC || !SnapshotIsFresh (h->taken) || !h->naccts || !h->strsz
+	    || (size_t) st.st_size != sizeof(*h) + h->naccts*(size_t)sizeof(*r) + h->strsz
+	    || strs[h->strsz-1]) {
+	munmap (p, st.st_size);
+	return (false);
+    }
+    for (unsigned i = 0; i < h->naccts; ++i) {
+	if (r[i].name >= h->strsz || r[i].dir >= h->strsz || r[i].shell >= h->strsz) {
+	    munmap (p, st.st_size);
+	    return (false);
+	}
+    }
+
+    _snapshot = p;
+    _snapshotsz = st.st_size;
+    _snapshotmtime = st.st_mtim;
+    _taken = h->taken;
+    _naccts = h->naccts;
+    _accstrs = (char*) strs;
+    _accstrsz = h->strsz;
+    _accts = (struct account*) xmalloc (_naccts*sizeof(struct account));
+    for (unsigned i = 0; i < _naccts; ++i) {
+	_accts[i].uid = r[i].uid;
+	_accts[i].gid = r[i].gid;
+	_accts[i].ltime = r[i].ltime;
+	_accts[i].name = _accstrs + r[i].name;
+	_accts[i].dir = _accstrs + r[i].dir;
+	_accts[i].shell = _accstrs + r[i].shell;
+    }
+    return (true);
+}
+
+// Write to a temporary file and rename, so concurrent readers always see complete contents
+bool ReplaceFile (const char* path, const void* buf, size_t sz)
+{
+    char tmppath [PATH_MAX];
+    snprintf (tmppath, sizeof(tmppath), "%s.%u", path, getpid());
+    int fd = open (tmppath, O_WRONLY| O_CREAT| O_TRUNC| O_CLOEXEC, 0644);
+    if (fd < 0)
+	return (false);
+    bool ok = (ssize_t) sz == write (fd, buf, sz);
+    if (0 != close (fd) || !ok || 0 != rename (tmppath, path)) {
+	syslog (LOG_WARNING, "unable to write %s: %m", path);
+	unlink (tmppath);
+	return (false);
+    }
+    return (true);
+}
+
+void WriteCacheFile (const char* path, const void* buf, size_t sz)
+{
+    if (0 == mkdir (PATH_LOGINX_CACHE, 0755) || errno == EEXIST)
+	ReplaceFile (path, buf, sz);
+}
+
+static void WriteSnapshot (void)
+{
+    if (!_naccts)
+	return;
+
+    // The string pool is written as is, so only the records need converting
+    const struct snaphdr h = { SNAPSHOT_MAGIC, _naccts, _accstrsz, 0, _taken };
+    const size_t recsz = _naccts*sizeof(struct snaprec), sz = sizeof(h) + recsz + h.strsz;
+    char* buf = (char*) xmalloc (sz);
+    memcpy (buf, &h, sizeof(h));
+    struct snaprec* r = (struct snaprec*) (buf + sizeof(h));
+    for (unsigned i = 0; i < _naccts; ++i) {
+	r[i].uid = _accts[i].uid;
+	r[i].gid = _accts[i].gid;
+	r[i].ltime = _accts[i].ltime;
+	r[i].name = _accts[i].name - _accstrs;
+	r[i].dir = _accts[i].dir - _accstrs;
+	r[i].shell = _accts[i].shell - _accstrs;
+    }
+    memcpy (buf + sizeof(h) + recsz, _accstrs, h.strsz);
+
+    WriteCacheFile (PATH_ACCOUNT_CACHE, buf, sz);
+    xfree (buf);
+}
+
+//}}}-------------------------------------------------------------------
+
+static uint32_t AddString (const char* s, size_t* cap)
+{
+    const size_t sl = strlen(s)+1;
+    if (_accstrsz + sl > *cap) {
+	while (_accstrsz + sl > *cap)
+	    *cap = *cap ? 2 * *cap : 4096;
+	_accstrs = (char*) xrealloc (_accstrs, *cap);
+    }
+    memcpy (_accstrs + _accstrsz, s, sl);
+    _accstrsz += sl;
+    return (_accstrsz - sl);
+}
+
+static void ReadAccounts (bool rebuild)
+{
+    if (!rebuild && LoadSnapshot())
+	return;
+
+    _taken = time (NULL);
+
+    // Records and strings are appended to growing arrays in one pass.
+    // Because the string pool moves when grown, records hold offsets
+    // into it until the enumeration is done.
+    unsigned nac = 0, acap = 0;
+    size_t scap = 0;
     setpwent();
     for (struct passwd* pw; (pw = getpwent());) {
 	if (!CanLogin (pw))
 	    continue;
-	_accts[nac] = (struct account*) xmalloc (sizeof(struct account));
-	_accts[nac]->uid = pw->pw_uid;
-	_accts[nac]->gid = pw->pw_gid;
-	_accts[nac]->name = strdup (pw->pw_name);
-	_accts[nac]->dir = strdup (pw->pw_dir);
-	_accts[nac]->shell = strdup (pw->pw_shell);
+	if (nac >= acap)
+	    _accts = (struct account*) xrealloc (_accts, (acap = acap ? 2*acap : 64)*sizeof(struct account));
+	_accts[nac].uid = pw->pw_uid;
+	_accts[nac].gid = pw->pw_gid;
+	_accts[nac].ltime = 0;
+	_accts[nac].name = (char*)(uintptr_t) AddString (pw->pw_name, &scap);
+	_accts[nac].dir = (char*)(uintptr_t) AddString (pw->pw_dir, &scap);
+	_accts[nac].shell = (char*)(uintptr_t) AddString (pw->pw_shell, &scap);
 	++nac;
     }
     endpwent();
+    for (unsigned i = 0; i < nac; ++i) {
+	_accts[i].name = _accstrs + (uintptr_t) _accts[i].name;
+	_accts[i].dir = _accstrs + (uintptr_t) _accts[i].dir;
+	_accts[i].shell = _accstrs + (uintptr_t) _accts[i].shell;
+    }
     _naccts = nac;
-    return ((acclist_t) _accts);
 }
 
-unsigned NAccounts (void)
+#if USE_LASTLOG_DB
+//{{{ Last login database ----------------------------------------------
+
+// The database is a header followed by a hash table of uid->time slots,
+// open addressed with linear probing. Each slot is one aligned 64-bit
+// word, so it is updated atomically in place and readers need no lock.
+// Writers hold an flock, and grow the table by replacing the file.
+
+struct lldbhdr {
+    uint32_t	magic;
+    uint32_t	nslots;		// Always a power of 2
+    uint32_t	nused;
+    uint32_t	reserved;
+};
+
+enum { LASTLOG_DB_MAGIC = 0x4c4c4431, LASTLOG_DB_MINSLOTS = 1024 };
+
+#define LLDB_SLOT(uid,t)	(((uint64_t)(t) << 32) | ((uint32_t)(uid)+1))	// Key 0 is an empty slot
+#define LLDB_KEY(slot)		((uint32_t)(slot))
+#define LLDB_TIME(slot)		((uint32_t)((slot) >> 32))
+
+// Returns the slot for uid, or the empty slot where it would go, or nslots if the table is full
+static unsigned LldbFind (const uint64_t* slots, uint32_t nslots, uid_t uid)
+{
+    unsigned i = (uid * 2654435761u) & (nslots-1);
+    for (unsigned n = 0; n < nslots; ++n, i = (i+1) & (nslots-1)) {
+	const uint64_t s = __atomic_load_n (&slots[i], __ATOMIC_RELAXED);
+	if (!s || LLDB_KEY(s) == (uint32_t) uid+1)
+	    return (i);
+    }
+    return (nslots);
+}
+
+static uint32_t LldbTime (const uint64_t* slots, uint32_t nslots, uid_t uid)
+{
+    const unsigned i = LldbFind (slots, nslots, uid);
+    return (i < nslots ? LLDB_TIME (__atomic_load_n (&slots[i], __ATOMIC_RELAXED)) : 0);
+}
+
+// Maps the database, checking that it is complete
+static struct lldbhdr* LldbMap (int fd, bool writable, size_t* sz)
+{
+    struct stat st;
+    if (0 != fstat (fd, &st) || (size_t) st.st_size < sizeof(struct lldbhdr))
+	return (NULL);
+    void* p = mmap (NULL, st.st_size, writable ? PROT_READ| PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+	return (NULL);
+    struct lldbhdr* h = (struct lldbhdr*) p;
+    if (h->magic != LASTLOG_DB_MAGIC || !h->nslots || (h->nslots & (h->nslots-1)) || h->nused >= h->nslots
+	    || (size_t) st.st_size != sizeof(*h) + h->nslots*sizeof(uint64_t)) {
+	munmap (p, st.st_size);
+	return (NULL);
+    }
+    *sz = st.st_size;
+    return (h);
+}
+
+static void ReadLastlogDbTimes (int fd)
+{
+    size_t sz;
+    const struct lldbhdr* h = LldbMap (fd, false, &sz);
+    if (!h)
+	return;
+    const uint64_t* slots = (const uint64_t*) (h+1);
+    for (unsigned i = 0; i < _naccts; ++i)
+	_accts[i].ltime = LldbTime (slots, h->nslots, _accts[i].uid);
+    munmap ((void*) h, sz);
+}
+
+// Creates a new database file with all entries of h, if any, with room for growth
+static bool LldbRebuild (const struct lldbhdr* h)
+{
+    // Counted instead of taken from nused, which a damaged file may understate
+    const uint64_t* slots = h ? (const uint64_t*) (h+1) : NULL;
+    uint32_t nused = 0;
+    for (unsigned i = 0; h && i < h->nslots; ++i)
+	nused += !!LLDB_KEY(slots[i]);
+    uint32_t nslots = LASTLOG_DB_MINSLOTS;
+    while (nslots < 4*nused)
+	nslots *= 2;
+    const size_t sz = sizeof(struct lldbhdr) + nslots*sizeof(uint64_t);
+    struct lldbhdr* nh = (struct lldbhdr*) xmalloc (sz);
+    nh->magic = LASTLOG_DB_MAGIC;
+    nh->nslots = nslots;
+    uint64_t* nslotv = (uint64_t*) (nh+1);
+    for (unsigned i = 0; h && i < h->nslots; ++i) {
+	if (!LLDB_KEY(slots[i]))
+	    continue;
+	nslotv[LldbFind (nslotv, nslots, LLDB_KEY(slots[i])-1)] = slots[i];
+	++nh->nused;
+    }
+    bool ok = ReplaceFile (PATH_LASTLOG_DB, nh, sz);
+    xfree (nh);
+    return (ok);
+}
+
+static void WriteLastlogDb (uid_t uid, uint32_t t)
+{
+    if (uid == (uid_t)-1 || (0 != mkdir (PATH_LOGINX_STATE, 0755) && errno != EEXIST))
+	return;
+    for (unsigned retries = 0; retries < 8; ++retries) {
+	int fd = open (PATH_LASTLOG_DB, O_RDWR| O_CLOEXEC);
+	if (fd < 0) {
+	    if (errno != ENOENT || !LldbRebuild (NULL))
+		return;
+	    continue;
+	}
+	// Lock, then make sure the file was not replaced while waiting
+	struct stat fst, pst;
+	if (0 != flock (fd, LOCK_EX) || 0 != fstat (fd, &fst) || 0 != stat (PATH_LASTLOG_DB, &pst)
+		|| fst.st_ino != pst.st_ino || fst.st_dev != pst.st_dev) {
+	    close (fd);
+	    continue;
+	}
+	size_t sz;
+	struct lldbhdr* h = LldbMap (fd, true, &sz);
+	bool done = false;
+	if (!h)	// Corrupt, so start over
+	    LldbRebuild (NULL);
+	else {
+	    uint64_t* slots = (uint64_t*) (h+1);
+	    unsigned i = LldbFind (slots, h->nslots, uid);
+	    if (i < h->nslots && (LLDB_KEY(slots[i]) || 4*(h->nused+1) <= 3*h->nslots)) {
+		h->nused += !LLDB_KEY(slots[i]);
+		__atomic_store_n (&slots[i], LLDB_SLOT(uid,t), __ATOMIC_RELEASE);
+		done = true;
+	    } else	// Too full; grow and retry
+		LldbRebuild (h);
+	    munmap (h, sz);
+	}
+	close (fd);
+	if (done)
+	    return;
+    }
+}
+
+//}}}-------------------------------------------------------------------
+#else
+
+static int CompareUidIndex (const void* a, const void* b)
+{
+    const uid_t ua = *(const uid_t*) a, ub = *(const uid_t*) b;
+    return ((ua > ub) - (ua < ub));
+}
+
+// The lastlog is indexed by uid and is mostly holes when uids are large.
+// Records are read in uid order, in batches, skipping the holes, so the
+// number of syscalls depends on the size of the data, not on naccts.
+static void ReadLastlogTimes (int fd, off_t fsize)
+{
+    struct uididx { uid_t uid; unsigned i; }* ui = (struct uididx*) xmalloc (_naccts*sizeof(struct uididx));
+    for (unsigned i = 0; i < _naccts; ++i) {
+	ui[i].uid = _accts[i].uid;
+	ui[i].i = i;
+    }
+    qsort (ui, _naccts, sizeof(struct uididx), CompareUidIndex);
+
+    enum { LASTLOG_BATCH = 256 };
+    struct lastlog* llb = (struct lastlog*) xmalloc (LASTLOG_BATCH*sizeof(struct lastlog));
+    off_t data = 0, hole = 0;	// Current data extent
+    for (unsigned i = 0; i < _naccts;) {
+	const off_t ro = (off_t) ui[i].uid * sizeof(struct lastlog);
+	if (ro + (off_t) sizeof(struct lastlog) > fsize)
+	    break;
+	if (ro >= hole) {
+	    if (0 > (data = lseek (fd, ro, SEEK_DATA))) {
+		if (errno == ENXIO)	// No more data after ro
+		    break;
+		data = ro;	// No sparse file support; all of it is data
+		hole = fsize;
+	    } else if (0 > (hole = lseek (fd, data, SEEK_HOLE)))
+		hole = fsize;
+	}
+	if (ro + (off_t) sizeof(struct lastlog) <= data) {
+	    ++i;	// In a hole, so never logged in
+	    continue;
+	}
+	// Read a batch starting at this record, up to the end of the extent
+	size_t n = hole > ro ? (hole - ro + sizeof(struct lastlog)-1) / sizeof(struct lastlog) : 1;
+	if (n > LASTLOG_BATCH)
+	    n = LASTLOG_BATCH;
+	ssize_t nr = pread (fd, llb, n*sizeof(struct lastlog), ro);
+	if (nr < (ssize_t) sizeof(struct lastlog))
+	    break;
+	const uid_t first = ui[i].uid, end = first + nr / sizeof(struct lastlog);
+	for (; i < _naccts && ui[i].uid < end; ++i)
+	    _accts[ui[i].i].ltime = llb[ui[i].uid - first].ll_time;
+    }
+    xfree (llb);
+    xfree (ui);
+}
+#endif
+
+static void ReadLastlog (void)
+{
+    int fd = open (PATH_LASTLOG, O_RDONLY| O_CLOEXEC);
+    if (fd >= 0) {
+	struct stat st;
+	if (fstat (fd, &st) == 0 && (!_snapshot || st.st_mtim.tv_sec > _snapshotmtime.tv_sec
+		|| (st.st_mtim.tv_sec == _snapshotmtime.tv_sec && st.st_mtim.tv_nsec >= _snapshotmtime.tv_nsec))) {
+	#if USE_LASTLOG_DB
+	    ReadLastlogDbTimes (fd);
+	#else
+	    ReadLastlogTimes (fd, st.st_size);
+	#endif
+	}
+	close (fd);
+    }
+    if (!_snapshot)
+	WriteSnapshot();
+}
+
+//{{{ Name index -------------------------------------------------------
+
+// Accounts are sorted by name, so a prefix selects a contiguous range
+// found by binary search. Over that order is a segment tree holding,
+// for each node, the position with the latest login time, so that the
+// most recently used accounts in any range are found in O(log N) each.
+
+enum { MRU_NONE = UINT_MAX };
+
+static int CompareAccountNames (const void* a, const void* b)
+{
+    return (strcmp (_accts[*(const unsigned*)a].name, _accts[*(const unsigned*)b].name));
+}
+
+// Returns the more recently used of two positions in _byname; earlier position on ties
+static unsigned MoreRecent (unsigned a, unsigned b)
+{
+    if (a == MRU_NONE || b == MRU_NONE)
+	return (a == MRU_NONE ? b : a);
+    const unsigned ta = _accts[_byname[a]].ltime, tb = _accts[_byname[b]].ltime;
+    return (ta > tb || (ta == tb && a < b) ? a : b);
+}
+
+static void BuildNameIndex (void)
+{
+    _byname = (unsigned*) xmalloc (_naccts*sizeof(unsigned));
+    for (unsigned i = 0; i < _naccts; ++i)
+	_byname[i] = i;
+    qsort (_byname, _naccts, sizeof(unsigned), CompareAccountNames);
+
+    for (_mruleaves = 1; _mruleaves < _naccts; _mruleaves *= 2) {}
+    _mrutree = (unsigned*) xmalloc (2*_mruleaves*sizeof(unsigned));
+    for (unsigned i = 0; i < _mruleaves; ++i)
+	_mrutree[_mruleaves+i] = i < _naccts ? i : MRU_NONE;
+    for (unsigned i = _mruleaves; --i;)
+	_mrutree[i] = MoreRecent (_mrutree[2*i], _mrutree[2*i+1]);
+}
+
+// Updates the login time of account ai and its path in the segment tree
+static void SetRecent (unsigned ai, uint32_t ltime)
+{
+    _accts[ai].ltime = ltime;
+    unsigned pos = 0;
+    while (pos < _naccts && _byname[pos] != ai)
+	++pos;
+    if (pos >= _naccts)
+	return;
+    for (unsigned i = (_mruleaves+pos)/2; i; i /= 2)
+	_mrutree[i] = MoreRecent (_mrutree[2*i], _mrutree[2*i+1]);
+}
+
+// Most recently used position in [f,l) of _byname
+static unsigned MostRecent (unsigned f, unsigned l)
+{
+    unsigned r = MRU_NONE;
+    for (f += _mruleaves, l += _mruleaves; f < l; f /= 2, l /= 2) {
+	if (f & 1)
+	    r = MoreRecent (r, _mrutree[f++]);
+	if (l & 1)
+	    r = MoreRecent (r, _mrutree[--l]);
+    }
+    return (r);
+}
+
+// Finds accounts with names starting with prefix. Returns their number,
+// and the first of them in name order in *first.
+unsigned FindAccounts (const char* prefix, unsigned* first)
+{
+    const size_t plen = strlen (prefix);
+    if (_loading || !_byname) {	// Only the last user is available
+	*first = 0;
+	return (NAccounts() && 0 == strncmp (Accounts()->name, prefix, plen));
+    }
+    unsigned f = 0, l = _naccts;
+    while (f < l) {
+	unsigned m = (f+l)/2;
+	if (strcmp (_accts[_byname[m]].name, prefix) < 0)
+	    f = m+1;
+	else
+	    l = m;
+    }
+    *first = f;
+    for (l = _naccts; f < l;) {
+	unsigned m = (f+l)/2;
+	if (0 == strncmp (_accts[_byname[m]].name, prefix, plen))
+	    f = m+1;
+	else
+	    l = m;
+    }
+    return (f - *first);
+}
+
+// The found range is taken in most recently used order by popping the
+// most recent position and splitting its range in two at it. Pending
+// ranges are kept in a heap by their most recent position, so each pick
+// is O(log N), and scrolling down the candidates takes one more.
+
+struct recentrange {
+    unsigned	f;
+    unsigned	l;
+    unsigned	best;	// Most recently used position in [f,l)
+};
+
+static bool RangeBefore (const struct recentrange* a, const struct recentrange* b)
+{
+    return (MoreRecent (a->best, b->best) == a->best);
+}
+
+static void PushRange (struct recentiter* it, unsigned f, unsigned l)
+{
+    if (f >= l)
+	return;
+    if (it->nr >= it->cap)
+	it->r = (struct recentrange*) xrealloc (it->r, (it->cap = it->cap ? 2*it->cap : 16)*sizeof(struct recentrange));
+    unsigned i = it->nr++;
+    const struct recentrange nr = { f, l, MostRecent (f, l) };
+    for (unsigned p; i && RangeBefore (&nr, &it->r[p = (i-1)/2]); i = p)
+	it->r[i] = it->r[p];
+    it->r[i] = nr;
+}
+
+static struct recentrange PopRange (struct recentiter* it)
+{
+    const struct recentrange top = it->r[0], last = it->r[--it->nr];
+    unsigned i = 0;
+    for (unsigned c; (c = 2*i+1) < it->nr; i = c) {
+	if (c+1 < it->nr && RangeBefore (&it->r[c+1], &it->r[c]))
+	    ++c;
+	if (!RangeBefore (&it->r[c], &last))
+	    break;
+	it->r[i] = it->r[c];
+    }
+    it->r[i] = last;
+    return (top);
+}
+
+// Starts taking the n accounts found by FindAccounts
+void StartRecentAccounts (unsigned first, unsigned n, struct recentiter* it)
+{
+    it->nr = 0;
+    it->nlast = 0;
+    if (_loading || !_byname)
+	it->nlast = n;
+    else
+	PushRange (it, first, first+n);
+}
+
+// Writes to ali up to k indexes of the next most recently used accounts. Returns the number written.
+unsigned RecentAccounts (struct recentiter* it, unsigned k, unsigned* ali)
+{
+    if (it->nlast) {
+	it->nlast = 0;
+	if (!k)
+	    return (0);
+	ali[0] = 0;
+	return (1);
+    }
+    unsigned na = 0;
+    while (na < k && it->nr) {
+	const struct recentrange r = PopRange (it);
+	ali[na++] = _byname[r.best];
+	PushRange (it, r.f, r.best);
+	PushRange (it, r.best+1, r.l);
+    }
+    return (na);
+}
+
+void EndRecentAccounts (struct recentiter* it)
+{
+    xfreenull (it->r);
+    it->nr = it->cap = it->nlast = 0;
+}
+
+//}}}-------------------------------------------------------------------
+//{{{ Supplementary groups
+
+// With directory services, initgroups can take longer than the password
+// check, so the groups of the highlighted account are resolved while the
+// login box is shown, and applied with setgroups after authentication.
+// The groups of the last logged in user are also cached on disk, where
+// they are good until the group sources change.
+
+struct groupscache {
+    uint32_t	uid;
+    uint32_t	gid;
+    uint32_t	ngroups;
+    uint32_t	reserved;
+    uint64_t	taken;		// When the list was looked up
+    uint32_t	groups [];
+};
+
+static pthread_mutex_t _groupslock = PTHREAD_MUTEX_INITIALIZER;
+static struct groupscache* _groups = NULL;	// Of the account last given to ResolveGroups
+static bool _groupslookedup = false;		// From NSS rather than the cache file
+
+static bool GroupsAreFresh (const struct groupscache* g, uid_t uid, gid_t gid)
 {
-    return (_naccts);
+    static const char c_GroupSources[][32] = {
+	"/var/lib/sss/mc/group",
+	"/var/lib/sss/mc/initgroups",
+	"/var/cache/nscd/group",
+	"/var/db/nscd/group"
+    };
+    if (!g || g->uid != uid || g->gid != gid || !SnapshotIsFresh (g->taken))
+	return (false);
+    for (unsigned i = 0; i < sizeof(c_GroupSources)/sizeof(c_GroupSources[0]); ++i) {
+	struct stat st;
+	if (0 == stat (c_GroupSources[i], &st) && st.st_mtime >= (time_t) g->taken)
+	    return (false);
+    }
+    return (true);
 }
 
-void ReadLastlog (void)
+static struct groupscache* ReadGroupsCache (uid_t uid, gid_t gid)
 {
-    int fd = open (_PATH_LASTLOG, O_RDONLY);
+    int fd = open (PATH_GROUPS_CACHE, O_RDONLY| O_CLOEXEC);
     if (fd < 0)
+	return (NULL);
+    struct groupscache h, *g = NULL;
+    if (sizeof(h) == read (fd, &h, sizeof(h)) && GroupsAreFresh (&h, uid, gid) && h.ngroups <= NGROUPS_MAX) {
+	const size_t gsz = h.ngroups*sizeof(h.groups[0]);
+	g = (struct groupscache*) xmalloc (sizeof(h) + gsz);
+	*g = h;
+	if ((ssize_t) gsz != read (fd, g->groups, gsz))
+	    xfreenull (g);
+    }
+    close (fd);
+    return (g);
+}
+
+static struct groupscache* LookupGroups (const char* name, uid_t uid, gid_t gid)
+{
+    int ngroups = 64;
+    struct groupscache* g = NULL;
+    for (int n = 0; n < ngroups && ngroups <= NGROUPS_MAX;) {
+	g = (struct groupscache*) xrealloc (g, sizeof(*g) + ngroups*sizeof(g->groups[0]));
+	g->uid = uid;
+	g->gid = gid;
+	g->reserved = 0;
+	g->taken = time (NULL);
+	n = ngroups;
+	if (0 > getgrouplist (name, gid, (gid_t*) g->groups, &ngroups) && ngroups <= n)
+	    ngroups = 2*n;	// Some NSS modules do not report the needed size
+	else if (ngroups <= n)
+	    break;
+    }
+    if (ngroups > NGROUPS_MAX)
+	xfreenull (g);
+    else
+	g->ngroups = ngroups;
+    return (g);
+}
+
+// Reads the groups of an account from the cache file, or looks them up,
+// without _groupslock, which is only taken to swap the result in.
+static struct groupscache* FetchGroups (const char* name, uid_t uid, gid_t gid, bool* lookedup)
+{
+    struct groupscache* g = ReadGroupsCache (uid, gid);
+    *lookedup = !g && (g = LookupGroups (name, uid, gid));
+    return (g);
+}
+
+// Makes g the resolved groups, returning the replaced list to be freed outside the lock
+static struct groupscache* SwapGroups (struct groupscache* g, bool lookedup)
+{
+    struct groupscache* old = _groups;
+    _groups = g;
+    _groupslookedup = lookedup;
+    return (old);
+}
+
+// Resolves the groups of the given account ahead of SetAccountGroups
+void ResolveGroups (const char* name, uid_t uid, gid_t gid)
+{
+    pthread_mutex_lock (&_groupslock);
+    const bool fresh = GroupsAreFresh (_groups, uid, gid);
+    pthread_mutex_unlock (&_groupslock);
+    if (fresh)
 	return;
-    struct stat st;
-    if (fstat (fd, &st) == 0) {
-	const unsigned maxuid = st.st_size / sizeof(struct lastlog);
-	for (unsigned i = 0; i < _naccts; ++i)
-	    if (_accts[i]->uid < maxuid)
-		pread (fd, &_accts[i]->ltime, sizeof(_accts[i]->ltime), _accts[i]->uid * sizeof(struct lastlog));
+    // A lookup can be a directory service round trip, which a login of another account must not wait for
+    bool lookedup;
+    struct groupscache* g = FetchGroups (name, uid, gid, &lookedup);
+    if (!g)
+	return;
+    pthread_mutex_lock (&_groupslock);
+    g = SwapGroups (g, lookedup);
+    pthread_mutex_unlock (&_groupslock);
+    xfree (g);
+}
+
+// Sets the supplementary groups of acct, looking them up if not resolved in advance
+void SetAccountGroups (const struct account* acct)
+{
+    pthread_mutex_lock (&_groupslock);
+    const bool resolved = GroupsAreFresh (_groups, acct->uid, acct->gid)
+			&& 0 == setgroups (_groups->ngroups, (const gid_t*) _groups->groups);
+    struct groupscache* towrite = NULL;	// A looked up list, copied to be kept for the next login without the lock
+    if (resolved && _groupslookedup) {
+	const size_t gsz = sizeof(*_groups) + _groups->ngroups*sizeof(_groups->groups[0]);
+	towrite = (struct groupscache*) memcpy (xmalloc (gsz), _groups, gsz);
+	_groupslookedup = false;
+    }
+    pthread_mutex_unlock (&_groupslock);
+    if (!resolved) {
+	bool lookedup;
+	struct groupscache* g = FetchGroups (acct->name, acct->uid, acct->gid, &lookedup);
+	if (g && 0 != setgroups (g->ngroups, (const gid_t*) g->groups))
+	    xfreenull (g);
+	if (!g)
+	    initgroups (acct->name, acct->gid);
+	else {
+	    if (lookedup)	// Keep for the next login
+		WriteCacheFile (PATH_GROUPS_CACHE, g, sizeof(*g) + g->ngroups*sizeof(g->groups[0]));
+	    pthread_mutex_lock (&_groupslock);
+	    g = SwapGroups (g, false);
+	    pthread_mutex_unlock (&_groupslock);
+	    xfree (g);
+	}
+    }
+    if (towrite)
+	WriteCacheFile (PATH_GROUPS_CACHE, towrite, sizeof(*towrite) + towrite->ngroups*sizeof(towrite->groups[0]));
+    xfree (towrite);
+}
+
+//}}}-------------------------------------------------------------------
+
+// Resolves the named account, with its last login time, into _lastuser
+static bool ResolveLastUser (const char* name)
+{
+    if (_nlastuser) {
+	xfree (_lastuser.name);
+	_nlastuser = 0;
+    }
+    const struct passwd* pw = getpwnam (name);
+    if (!pw || !CanLogin (pw))
+	return (false);
+
+    _lastuser.uid = pw->pw_uid;
+    _lastuser.gid = pw->pw_gid;
+    const size_t namesz = strlen(pw->pw_name)+1, dirsz = strlen(pw->pw_dir)+1, shellsz = strlen(pw->pw_shell)+1;
+    _lastuser.name = (char*) xmalloc (namesz + dirsz + shellsz);
+    _lastuser.dir = (char*) memcpy (_lastuser.name + namesz, pw->pw_dir, dirsz);
+    _lastuser.shell = (char*) memcpy (_lastuser.dir + dirsz, pw->pw_shell, shellsz);
+    memcpy (_lastuser.name, pw->pw_name, namesz);
+    _nlastuser = 1;
+    _lastuser.ltime = 0;	// Left as never, if there is no record
+    int fd = open (PATH_LASTLOG, O_RDONLY| O_CLOEXEC);
+    if (fd >= 0) {
+    #if USE_LASTLOG_DB
+	size_t sz;
+	const struct lldbhdr* h = LldbMap (fd, false, &sz);
+	if (h) {
+	    const uint64_t* slots = (const uint64_t*) (h+1);
+	    _lastuser.ltime = LldbTime (slots, h->nslots, _lastuser.uid);
+	    munmap ((void*) h, sz);
+	}
+    #else
+	pread (fd, &_lastuser.ltime, sizeof(_lastuser.ltime), _lastuser.uid * sizeof(struct lastlog));
+    #endif
+	close (fd);
     }
+    return (true);
+}
+
+// The most recent user is resolved directly, to show the login box before the enumeration is done
+static void ReadLastUser (void)
+{
+    char name [64];
+    int fd = open (PATH_LASTUSER_CACHE, O_RDONLY| O_CLOEXEC);
+    if (fd < 0)
+	return;
+    ssize_t nr = read (fd, name, sizeof(name)-1);
     close (fd);
+    if (nr <= 0)
+	return;
+    name[nr] = 0;
+    ResolveLastUser (name);
+}
+
+static void ReadTTYGroup (void)
+{
+    _ttygroup = getgid();
+    struct group* ttygr = getgrnam("tty");
+    if (ttygr)	// If no tty group, use user's primary group
+	_ttygroup = ttygr->gr_gid;
+    endgrent();
+}
+
+static void* AccountLoader (void* rebuild)
+{
+    unsigned t = TraceBegin ("ReadAccounts");
+    ReadAccounts ((bool)(uintptr_t) rebuild);
+    TraceEnd (t);
+    t = TraceBegin ("ReadLastlog");
+    ReadLastlog();
+    TraceEnd (t);
+    BuildNameIndex();
+    close (_loaderfd[1]);
+    return (NULL);
+}
+
+int LoadAccounts (bool rebuild)
+{
+    if (_accts || _loading)	// Already loaded, as when inherited from the daemon
+	return (-1);
+    static bool s_AtExit = false;
+    if (!s_AtExit)
+	atexit (CleanupAccounts);
+    s_AtExit = true;
+    ReadTTYGroup();
+    ReadLastUser();
+
+    if (0 != pipe2 (_loaderfd, O_CLOEXEC))
+	ExitWithError ("pipe2");
+    _loading = true;
+    // The loader may still be running in the session, when the last user
+    // logs in before the list is done, and must not take its signals.
+    sigset_t all, omask;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &omask);
+    const bool started = (0 == pthread_create (&_loader, NULL, AccountLoader, (void*)(uintptr_t) rebuild));
+    pthread_sigmask (SIG_SETMASK, &omask, NULL);
+    if (!started) {
+	_loading = false;
+	AccountLoader ((void*)(uintptr_t) rebuild);
+    }
+    return (_loaderfd[0]);
+}
+
+// Resolves only the named account, for autologin without the account list
+const struct account* AutologinAccount (const char* name)
+{
+    static bool s_AtExit = false;
+    if (!s_AtExit)
+	atexit (CleanupAccounts);
+    s_AtExit = true;
+    ReadTTYGroup();
+    return (ResolveLastUser (name) ? &_lastuser : NULL);
+}
+
+void AccountsLoaded (void)
+{
+    if (!_loading)
+	return;
+    pthread_join (_loader, NULL);
+    _loading = false;
+    close (_loaderfd[0]);
+    _loaderfd[0] = _loaderfd[1] = -1;
+}
+
+// Moves acct up in the recently used order of the loaded list, for the next login box in persistent mode
+void AccountLoggedOut (const struct account* acct)
+{
+    if (!_loading && acct >= _accts && acct < _accts+_naccts)
+	SetRecent (acct-_accts, _loginltime);
+}
+
+// Reloads the account list if any of its sources changed since it was read
+void RefreshAccounts (void)
+{
+    if (_loading || !_accts || SnapshotIsFresh (_taken))
+	return;
+    FreeAccounts();
+    ReadAccounts (false);
+    ReadLastlog();
+    BuildNameIndex();
+}
+
+acclist_t Accounts (void)
+{
+    return (_loading ? &_lastuser : _accts);
+}
+
+unsigned NAccounts (void)
+{
+    return (_loading ? _nlastuser : _naccts);
 }
 
 void WriteLastlog (const struct account* acct)
 {
-    int fd = open (_PATH_LASTLOG, O_WRONLY| O_CREAT, 644);
-    if (fd < 0)
+    const uint32_t ltime = time (NULL);
+#if USE_LASTLOG_DB
+    WriteLastlogDb (acct->uid, ltime);
+#else
+    int fd = open (PATH_LASTLOG, O_WRONLY| O_CREAT| O_CLOEXEC, 0644);
+    if (fd >= 0) {
+	struct lastlog ll;
+	memset (&ll, 0, sizeof(ll));
+	ll.ll_time = ltime;
+	strncpy (ll.ll_line, _ttypath+strlen("/dev/"), sizeof(ll.ll_line)-1);
+	gethostname (ll.ll_host, sizeof(ll.ll_host)-1);
+	pwrite (fd, &ll, sizeof(ll), acct->uid*sizeof(ll));
+	close (fd);
+    }
+#endif
+
+    WriteCacheFile (PATH_LASTUSER_CACHE, acct->name, strlen(acct->name));
+
+    // The loaded list keeps the previous time until logout, to be shown in the motd
+    _loginltime = ltime;
+    if (_loading || acct < _accts || acct >= _accts+_naccts)
 	return;
 
-    struct lastlog ll;
-    memset (&ll, 0, sizeof(ll));
-    ll.ll_time = time(NULL);
-    strncpy (ll.ll_line, _ttypath+strlen("/dev/"), sizeof(ll.ll_line)-1);
-    gethostname (ll.ll_host, sizeof(ll.ll_host)-1);
+    // Keep the snapshot current, otherwise the lastlog would have to be reread on every start
+    if (!_snapshot)
+	return;
+    int sfd = open (PATH_ACCOUNT_CACHE, O_RDWR| O_CLOEXEC);
+    if (sfd >= 0) {
+	// The snapshot may have been replaced by another instance, so check the record is still there
+	const off_t recoff = sizeof(struct snaphdr) + (acct-_accts)*sizeof(struct snaprec);
+	uint32_t uid = 0;
+	if (sizeof(uid) == pread (sfd, &uid, sizeof(uid), recoff + offsetof(struct snaprec,uid)) && uid == acct->uid)
+	    pwrite (sfd, &ltime, sizeof(ltime), recoff + offsetof(struct snaprec,ltime));
+	close (sfd);
+    }
+}
 
-    pwrite (fd, &ll, sizeof(ll), acct->uid*sizeof(ll));
+// The utmp record of this tty is found once and then updated in place,
+// instead of searching the whole file on every write as pututline does.
+static int _utmpfd = -1;
+static off_t _utmpslot = -1;	// Offset of the record for this tty
+static short _utmptype = 0;	// Last written state, to merge repeated transitions
+static pid_t _utmppid = 0;
 
-    close (fd);
+static bool IsTTYRecord (const struct utmp* ut, const char* id)
+{
+    return (ut->ut_type >= INIT_PROCESS && ut->ut_type <= DEAD_PROCESS && 0 == strncmp (ut->ut_id, id, sizeof(ut->ut_id)));
+}
+
+// Returns the offset of the record for tty id, or where to append it
+static off_t FindUtmpSlot (int fd, const char* id)
+{
+    struct utmp ub [64];
+    for (off_t o = 0;; o += sizeof(ub)) {
+	ssize_t br = pread (fd, ub, sizeof(ub), o);
+	unsigned n = br > 0 ? br/sizeof(ub[0]) : 0;
+	for (unsigned i = 0; i < n; ++i)
+	    if (IsTTYRecord (&ub[i], id))
+		return (o + i*sizeof(ub[0]));
+	if (n < sizeof(ub)/sizeof(ub[0]))
+	    return (o + n*sizeof(ub[0]));
+    }
 }
 
 void WriteUtmp (const struct account* acct, pid_t pid, short uttype)
 {
+    if (uttype == _utmptype && pid == _utmppid)
+	return;
+    _utmptype = uttype;
+    _utmppid = pid;
+
     struct utmp ut;
     memset (&ut, 0, sizeof(ut));
     ut.ut_type = uttype;
@@ -119,13 +1049,22 @@ void WriteUtmp (const struct account* acct, pid_t pid, short uttype)
     ut.ut_tv.tv_sec = tv.tv_sec;
     ut.ut_tv.tv_usec = tv.tv_usec;
 
-    if (0 != utmpname (_PATH_UTMP))
-	syslog (LOG_ERR, "unable to open " _PATH_UTMP ": %m");
-    setutent();
-    if (!pututline (&ut))
-	syslog (LOG_ERR, "unable to write utmp record: %m");
-    endutent();
+    if (_utmpfd < 0 && 0 > (_utmpfd = open (PATH_UTMP, O_RDWR| O_CLOEXEC)))
+	syslog (LOG_ERR, "unable to open " PATH_UTMP ": %m");
+    else {
+	// Lock the whole file, as glibc does
+	struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	while (0 > fcntl (_utmpfd, F_SETLKW, &lk) && errno == EINTR) {}
+	// The file may have been rewritten by another process, so check the slot is still ours
+	struct utmp cur;
+	if (_utmpslot < 0 || sizeof(cur) != pread (_utmpfd, &cur, sizeof(cur), _utmpslot) || !IsTTYRecord (&cur, ut.ut_id))
+	    _utmpslot = FindUtmpSlot (_utmpfd, ut.ut_id);
+	if (sizeof(ut) != pwrite (_utmpfd, &ut, sizeof(ut), _utmpslot))
+	    syslog (LOG_ERR, "unable to write utmp record: %m");
+	lk.l_type = F_UNLCK;
+	fcntl (_utmpfd, F_SETLK, &lk);
+    }
 
     if (ut.ut_type != DEAD_PROCESS)
-	updwtmp (_PATH_WTMP, &ut);
+	updwtmp (PATH_WTMP, &ut);
 }
@@ -4,8 +4,14 @@
 // This file is free software, distributed under the MIT License.
 
 #include "defs.h"
-#include <ncurses.h>
+#if USE_ANSI_UI
+    #include "ansi.h"
+#else
+    #include <ncurses.h>
+#endif
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
 
 #ifndef COLOR_DEFAULT
     #define COLOR_DEFAULT -1
@@ -17,25 +23,66 @@ enum {
     MAX_PROMPT_WIDTH = sizeof(PASSWORD_PROMPT)-1,
     MAX_INPUT_WIDTH = sizeof(PASSWORD_MASKSTR),
     LOGIN_WINDOW_WIDTH = 1+2+MAX_PROMPT_WIDTH+4+MAX_INPUT_WIDTH+2+1,
-    LOGIN_WINDOW_HEIGHT = 1+4+1
+    LOGIN_WINDOW_HEIGHT = 1+4+1,
+    CANDIDATE_ROWS = 6,
+    AUTH_TICK_MS = 100,		// Progress indicator update interval
+    RETRY_TICK_MS = 1000,	// Retry countdown update interval
+    KEY_ACCOUNTS_LOADED = KEY_MAX+1,
+    KEY_AUTH_DONE,
+    KEY_AUTH_TICK
+};
+
+// Type-ahead username search state
+struct search {
+    char	prefix [MAX_INPUT_WIDTH];
+    unsigned	plen;
+    unsigned	first;		// Range of matching accounts in name order
+    unsigned	n;
+    unsigned	sel;		// Selected candidate, in most recently used order
+    unsigned	top;		// First shown candidate
+    unsigned*	cand;		// Account indexes of candidates up to the last shown
+    unsigned	ncand;
+    unsigned	candcap;
+    struct recentiter recent;	// Where the candidates after cand continue
 };
 
 //----------------------------------------------------------------------
 
 static WINDOW* _loginbox = NULL;
+static WINDOW* _candbox = NULL;
+
+// Failed logins on this tty, to delay retries. These are kept in a file
+// too, so that quitting loginx to be respawned does not reset them.
+static unsigned _nfailed = 0;
+static time_t _lastfailed = 0;
+static bool _failedread = false;
 
 //----------------------------------------------------------------------
 
 static void CursesInit (void);
 static void CursesCleanup (void);
+static int GetKey (int* loadfd, int* authfd, int timeout);
+static void ReadFailedLogins (void);
+static void WriteFailedLogins (void);
+static void LoginFailed (const struct account* acct);
+static time_t RetryTime (void);
+static void FindCandidates (struct search* s);
+static void DrawCandidates (const struct search* s, acclist_t al);
+static bool SearchKey (struct search* s, int key);
+static unsigned DefaultAccount (acclist_t al, unsigned aln, const struct account* sel);
 
 //----------------------------------------------------------------------
 
 static void CursesInit (void)
 {
+    static bool s_Initialized = false;
     if (!initscr())
 	ExitWithMessage ("failed to initialize curses");
-    atexit (CursesCleanup);
+    if (s_Initialized)	// In persistent mode, after a session has used the screen
+	clearok (curscr, true);
+    else
+	atexit (CursesCleanup);
+    s_Initialized = true;
     start_color();
     use_default_colors();
     init_pair (1, COLOR_BLACK, COLOR_WHITE);
@@ -46,58 +93,320 @@ static void CursesCleanup (void)
 {
     if (isendwin())
 	return;
+    if (_candbox)
+	delwin (_candbox);
+    _candbox = NULL;
     if (_loginbox)
 	delwin (_loginbox);
+    _loginbox = NULL;
     endwin();
 }
 
-unsigned LoginBox (acclist_t al, char* password)
+const struct account* LoginBox (int loadfd)
 {
+    unsigned t = TraceBegin ("CursesInit");
     CursesInit();
+    TraceEnd (t);
 
-    if (!(_loginbox = newwin (LOGIN_WINDOW_HEIGHT, LOGIN_WINDOW_WIDTH, (LINES-LOGIN_WINDOW_HEIGHT)/2, (COLS-LOGIN_WINDOW_WIDTH)/2)))
+    const int boxy = (LINES-LOGIN_WINDOW_HEIGHT)/2, boxx = (COLS-LOGIN_WINDOW_WIDTH)/2;
+    if (!(_loginbox = newwin (LOGIN_WINDOW_HEIGHT, LOGIN_WINDOW_WIDTH, boxy, boxx))
+	    || !(_candbox = newwin (CANDIDATE_ROWS, LOGIN_WINDOW_WIDTH, boxy+LOGIN_WINDOW_HEIGHT, boxx)))
 	ExitWithMessage ("failed to create login window");
     keypad (_loginbox, true);
     nodelay (_loginbox, false);
     wbkgd (_loginbox, COLOR_PAIR(1)|' ');
 
     int key;
+    char password [MAX_PW_LEN];
     unsigned pwlen = 0;
-    const unsigned aln = NAccounts();
-    if (!aln)
-	ExitWithMessage ("no usable accounts found");
-    memset (password, 0, MAX_PW_LEN);
+    memset (password, 0, sizeof(password));
+    struct search srch;
+    memset (&srch, 0, sizeof(srch));
+    bool searching = false, done = false;
 
-    // Make last logged in user default
-    unsigned ali = 0;
-    for (unsigned i = 0; i < aln; ++i)
-	if (al[ali]->ltime <= al[i]->ltime)
-	    ali = i;
+    // Until all accounts are loaded, this will contain only the last user
+    acclist_t al = Accounts();
+    unsigned aln = NAccounts();
+    unsigned ali = DefaultAccount (al, aln, NULL);
+    const char* pamuser = NULL;	// Last selection given to PAM
+    const struct account* prefetched = NULL;	// Last highlighted account given to PrefetchSession
+
+    // Login runs in the background, with a progress indicator and a deadline
+    const struct account* acct = NULL;
+    int authfd = -1;
+    time_t authstart = 0;
+    unsigned authticks = 0;
+    const char* status = NULL;
+    if (!_failedread)
+	ReadFailedLogins();
+    time_t retry = RetryTime();	// No logins until then
 
     do {
+	// The PAM handle belongs to the login thread until it is done
+	if (authfd < 0 && aln && !searching && pamuser != al[ali].name && PamSetUser (al[ali].name))
+	    pamuser = al[ali].name;
+	const struct account* hl = !aln ? NULL : !searching ? &al[ali] : srch.n ? &al[srch.cand[srch.sel]] : NULL;
+	if (hl && (!prefetched || 0 != strcmp (hl->name, prefetched->name)))
+	    PrefetchSession (prefetched = hl);
 	wattrset (_loginbox, COLOR_PAIR(1));
 	werase (_loginbox);
 	//box (_loginbox, 0, 0);
 	mvwaddstr (_loginbox, 2,3, USERNAME_PROMPT);
 	mvwaddstr (_loginbox, 3,3, PASSWORD_PROMPT);
 	wattrset (_loginbox, COLOR_PAIR(1));
-	mvwaddnstr (_loginbox, 2,3+sizeof(USERNAME_PROMPT), al[ali]->name, MAX_INPUT_WIDTH);
 	mvwaddnstr (_loginbox, 3,3+sizeof(PASSWORD_PROMPT), PASSWORD_MASKSTR, min(strlen(PASSWORD_MASKSTR),pwlen));
-	wrefresh (_loginbox);
-	key = wgetch (_loginbox);
-	if (isprint(key) && pwlen < MAX_PW_LEN-1)
+	if (searching)
+	    mvwaddstr (_loginbox, 2,3+sizeof(USERNAME_PROMPT), srch.prefix);
+	else if (aln)
+	    mvwaddnstr (_loginbox, 2,3+sizeof(USERNAME_PROMPT), al[ali].name, MAX_INPUT_WIDTH);
+	const time_t now = time (NULL);
+	if (authfd >= 0) {
+	    static const char c_Spinner[] = "|/-\\";
+	    mvwprintw (_loginbox, 4,3, "Logging in %c", c_Spinner[authticks % (sizeof(c_Spinner)-1)]);
+	} else if (now < retry)
+	    mvwprintw (_loginbox, 4,3, "%s, wait %lds", _nfailed >= LOGIN_LOCKOUT_FAILURES ? "Locked" : "Login incorrect", (long)(retry-now));
+	else if (status)
+	    mvwaddstr (_loginbox, 4,3, status);
+	// Leave the cursor where the next character goes, so that typing it moves no cursor
+	if (searching)
+	    wmove (_loginbox, 2,3+sizeof(USERNAME_PROMPT)+srch.plen);
+	else
+	    wmove (_loginbox, 3,3+sizeof(PASSWORD_PROMPT)+min(strlen(PASSWORD_MASKSTR),pwlen));
+	DrawCandidates (searching ? &srch : NULL, al);
+	wnoutrefresh (_loginbox);	// Last, to leave the cursor in the box
+	doupdate();
+	key = GetKey (&loadfd, &authfd, now < retry ? RETRY_TICK_MS : -1);
+	if (key == KEY_AUTH_DONE) {
+	    if (PamLoginResult())
+		done = true;
+	    else {
+		// Only a rejected password counts toward the lockout
+		if (PamAuthFailed()) {
+		    LoginFailed (acct);
+		    retry = RetryTime();
+		    status = "Login incorrect";
+		} else
+		    status = "Unable to open session";
+		memset (password, 0, sizeof(password));
+		pwlen = 0;
+	    }
+	    continue;
+	} else if (authfd >= 0) {
+	    ++authticks;
+	    if (key == 27 || time (NULL) >= authstart + AUTH_TIMEOUT) {
+		// A PAM module can not be interrupted, so quit and let the tty be respawned.
+		// The login is counted as failed, to not get around the retry delay.
+		CursesCleanup();
+		syslog (LOG_ERR, "login of %s %s", acct->name, key == 27 ? "canceled" : "timed out");
+		LoginFailed (acct);
+		PamLoginCanceled();
+		exit (EXIT_FAILURE);
+	    }
+	    continue;
+	}
+	if (key == KEY_AUTH_TICK)	// Retry countdown
+	    continue;
+	status = NULL;
+	if (!key) {	// A break, or garbage at the wrong line speed
+	    if (NextTTYSpeed())
+		clearok (curscr, true);
+	} else if (key == KEY_ACCOUNTS_LOADED) {
+	    const struct account* sel = aln ? &al[ali] : NULL;
+	    AccountsLoaded();
+	    al = Accounts();
+	    if (!(aln = NAccounts()))
+		ExitWithMessage ("no usable accounts found");
+	    ali = DefaultAccount (al, aln, sel);
+	    if (searching)
+		FindCandidates (&srch);
+	} else if (!aln)
+	    continue;
+	else if (!searching && (key == KEY_LEFT || key == KEY_BTAB)) {	// Start username search
+	    searching = true;
+	    srch.prefix[srch.plen = 0] = 0;
+	    FindCandidates (&srch);
+	} else if (searching) {
+	    if (!SearchKey (&srch, key)) {	// Search done
+		if (srch.n && key != 27)
+		    ali = srch.cand[srch.sel];
+		searching = false;
+	    }
+	} else if (isprint(key) && pwlen < MAX_PW_LEN-1)
 	    password[pwlen++] = key;
 	else if (key == KEY_BACKSPACE && pwlen > 0)
 	    password[--pwlen] = 0;
 	else if (key == KEY_UP)
-	    ali = (ali-1) % aln;
+	    ali = (ali+aln-1) % aln;
 	else if (key == KEY_DOWN || key == '\t')
 	    ali = (ali+1) % aln;
-    } while (key != '\n');
+	else if (key == '\n' && time (NULL) >= retry) {
+	    acct = &al[ali];
+	    authfd = PamLogin (acct, password);
+	    authstart = time (NULL);
+	    authticks = 0;
+	}
+    } while (!done);
 
-    delwin (_loginbox);
+    memset (password, 0, sizeof(password));
+    xfree (srch.cand);
+    EndRecentAccounts (&srch.recent);
     CursesCleanup();
+    RestoreTTYSpeed();
+    if (_nfailed) {
+	_nfailed = 0;
+	WriteFailedLogins();
+    }
+
+    return (acct);
+}
+
+// Finds candidates for the current prefix and selects the most recent
+static void FindCandidates (struct search* s)
+{
+    s->n = FindAccounts (s->prefix, &s->first);
+    s->sel = s->top = 0;
+    if (s->candcap < CANDIDATE_ROWS)
+	s->cand = (unsigned*) xrealloc (s->cand, (s->candcap = CANDIDATE_ROWS)*sizeof(unsigned));
+    StartRecentAccounts (s->first, s->n, &s->recent);
+    s->ncand = RecentAccounts (&s->recent, CANDIDATE_ROWS, s->cand);
+}
+
+// Handles a key in username search, returning false when it is done
+static bool SearchKey (struct search* s, int key)
+{
+    if (isprint(key) && s->plen < sizeof(s->prefix)-1) {
+	s->prefix[s->plen++] = key;
+	s->prefix[s->plen] = 0;
+	FindCandidates (s);
+    } else if (key == KEY_BACKSPACE && s->plen) {
+	s->prefix[--s->plen] = 0;
+	FindCandidates (s);
+    } else if (key == KEY_UP && s->sel)
+	s->top = min (s->top, --s->sel);
+    else if (key == KEY_DOWN && s->sel+1 < s->n) {
+	if (++s->sel >= s->top+CANDIDATE_ROWS)
+	    s->top = s->sel+1-CANDIDATE_ROWS;
+	if (s->sel >= s->ncand) {	// Scrolled down to a new candidate
+	    if (s->ncand >= s->candcap)
+		s->cand = (unsigned*) xrealloc (s->cand, (s->candcap *= 2)*sizeof(unsigned));
+	    s->ncand += RecentAccounts (&s->recent, 1, s->cand+s->ncand);
+	}
+    } else if (key == '\n' || key == '\t' || key == KEY_RIGHT || key == KEY_BTAB || key == 27)
+	return (false);
+    return (true);
+}
+
+// Shows the candidates under the login box, or hides the list if s is NULL
+static void DrawCandidates (const struct search* s, acclist_t al)
+{
+    wbkgdset (_candbox, s ? COLOR_PAIR(1)|' ' : ' ');
+    werase (_candbox);
+    for (unsigned i = 0; s && i < CANDIDATE_ROWS && s->top+i < s->ncand; ++i) {
+	wattrset (_candbox, s->top+i == s->sel ? COLOR_PAIR(1)|A_REVERSE : COLOR_PAIR(1));
+	mvwaddnstr (_candbox, i,3+sizeof(USERNAME_PROMPT), al[s->cand[s->top+i]].name, MAX_INPUT_WIDTH);
+    }
+    wnoutrefresh (_candbox);
+}
+
+// Waits for a key, for the account loader to finish, or for login progress.
+// The loaded list is not taken while logging in, because the account being
+// logged in points into the current one.
+static int GetKey (int* loadfd, int* authfd, int timeout)
+{
+    if (*authfd >= 0)
+	timeout = AUTH_TICK_MS;
+    if (*loadfd >= 0 || *authfd >= 0 || timeout >= 0) {
+	// poll ignores negative fds
+	struct pollfd pfd[3] = {{ STDIN_FILENO, POLLIN, 0 }, { *authfd < 0 ? *loadfd : -1, POLLIN, 0 }, { *authfd, POLLIN, 0 }};
+	int r;
+	while (0 > (r = poll (pfd, 3, timeout)))
+	    if (errno != EINTR)
+		ExitWithError ("poll");
+	if (pfd[1].revents) {
+	    *loadfd = -1;
+	    return (KEY_ACCOUNTS_LOADED);
+	} else if (pfd[2].revents) {
+	    *authfd = -1;
+	    return (KEY_AUTH_DONE);
+	} else if (!r)
+	    return (KEY_AUTH_TICK);
+    }
+    return (wgetch (_loginbox));
+}
+
+// The file is named after the tty, as in tty1 or pts-0
+static void FailedLoginsPath (char* path, size_t pathsz)
+{
+    snprintf (path, pathsz, PATH_LOGINX_RUN "/%s", _ttypath+strlen(_PATH_DEV));
+    for (char* p = path+sizeof(PATH_LOGINX_RUN); *p; ++p)
+	if (*p == '/')
+	    *p = '-';
+}
+
+static void ReadFailedLogins (void)
+{
+    _failedread = true;
+    char path [PATH_MAX];
+    FailedLoginsPath (path, sizeof(path));
+    FILE* f = fopen (path, "re");
+    if (!f)
+	return;
+    long lastfailed;
+    if (2 == fscanf (f, "%u %ld", &_nfailed, &lastfailed))
+	_lastfailed = lastfailed;
+    else
+	_nfailed = 0;
+    fclose (f);
+}
+
+static void WriteFailedLogins (void)
+{
+    char path [PATH_MAX];
+    FailedLoginsPath (path, sizeof(path));
+    if (!_nfailed)
+	unlink (path);
+    else if (0 == mkdir (PATH_LOGINX_RUN, 0700) || errno == EEXIST) {
+	char buf [32];
+	ReplaceFile (path, buf, snprintf (buf, sizeof(buf), "%u %ld\n", _nfailed, (long) _lastfailed));
+    }
+}
+
+// Counts a failed login. Failures are forgotten after a lockout window without any.
+static void LoginFailed (const struct account* acct)
+{
+    const time_t now = time (NULL);
+    if (now >= _lastfailed + LOGIN_LOCKOUT_WINDOW)
+	_nfailed = 0;
+    _lastfailed = now;
+    // The message is copied from util-linux login to allow log grepping compatibility
+    syslog (LOG_NOTICE, "FAILED LOGIN %u ON %s FOR %s", ++_nfailed, _ttypath+strlen(_PATH_DEV), acct->name);
+    WriteFailedLogins();
+    if (_nfailed == LOGIN_LOCKOUT_FAILURES)
+	syslog (LOG_WARNING, "too many failed logins on %s; locked for %u s", _ttypath+strlen(_PATH_DEV), LOGIN_LOCKOUT_WINDOW);
+}
+
+// Returns when the next login may be tried. After the first few failures,
+// the delay doubles with each failure, up to locking the tty for the window.
+static time_t RetryTime (void)
+{
+    if (_nfailed >= LOGIN_LOCKOUT_FAILURES)
+	return (_lastfailed + LOGIN_LOCKOUT_WINDOW);
+    if (_nfailed <= LOGIN_RETRY_FREE)
+	return (0);
+    const unsigned n = min (_nfailed-LOGIN_RETRY_FREE-1, 16u);
+    return (_lastfailed + min (LOGIN_RETRY_DELAY << n, LOGIN_LOCKOUT_WINDOW));
+}
 
+// Keeps the current selection in the new list, or makes last logged in user default
+static unsigned DefaultAccount (acclist_t al, unsigned aln, const struct account* sel)
+{
+    unsigned ali = 0;
+    for (unsigned i = 0; i < aln; ++i) {
+	if (sel && al[i].uid == sel->uid && 0 == strcmp (al[i].name, sel->name))
+	    return (i);
+	if (al[ali].ltime <= al[i].ltime)
+	    ali = i;
+    }
     return (ali);
 }
 
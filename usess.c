@@ -1,128 +1,295 @@
 #include "defs.h"
 #include <sys/sendfile.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/fsuid.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <time.h>
 #include <utmp.h>
+#if HAVE_SYS_PIDFD_H
+    #include <sys/pidfd.h>
+#endif
 
 //----------------------------------------------------------------------
 
-static void QuitSignal (int sig);
-static void AlarmSignal (int sig);
-/* static void XreadySignal (int sig); */
-static void ChildSignal (int sig);
-static void BecomeUser (const struct account* acct);
+static void BecomeUser (const struct account* acct, const char** envp);
 static void RedirectToLog (void);
 static void WriteMotd (const struct account* acct);
-/* static pid_t LaunchX (const struct account* acct); */
-static pid_t LaunchShell (const struct account* acct, const char* arg);
+static void EndSession (const sigset_t* smask, bool* quitting);
+static pid_t MotdGenerator (void);
+static bool ReapedMotdGenerator (pid_t pid, int status);
+static pid_t LaunchX (const struct account* acct, char* display, size_t displaysz, const sigset_t* omask);
+static pid_t LaunchShell (const struct account* acct, const char* display, const sigset_t* omask);
 
-//----------------------------------------------------------------------
-
-static bool _quitting = false;
-/* static bool _xready = false; */
-static int _killsig = SIGTERM;
+#if !HAVE_SYS_PIDFD_H	// Before glibc 2.36, pidfd_open has no wrapper
+static int pidfd_open (pid_t pid, unsigned flags)
+{
+#ifdef SYS_pidfd_open
+    return (syscall (SYS_pidfd_open, pid, flags));
+#else
+    (void) pid; (void) flags;
+    errno = ENOSYS;	// Falls back to SIGCHLD
+    return (-1);
+#endif
+}
+#endif
 
 //----------------------------------------------------------------------
 
-void RunSession (const struct account* acct)
+// Returns false if the session was ended by a signal to loginx, rather than by logout
+bool RunSession (const struct account* acct)
 {
-    // Check if need to launch X
-    /* char xinitrcPath [PATH_MAX]; */
-    /* snprintf (xinitrcPath, sizeof(xinitrcPath), "%s/.xinitrc", acct->dir); */
+    // Session events are all waited for in one epoll loop: signals come
+    // from a signalfd, the shell exit from a pidfd, and escalation from
+    // SIGTERM to SIGKILL from a timerfd. The signals are blocked before
+    // the shell is forked, so none can be missed, and the shell gets the
+    // original mask back.
+    sigset_t smask, omask;
+    sigemptyset (&smask);
+    sigaddset (&smask, SIGCHLD);
+    sigaddset (&smask, SIGHUP);
+    sigaddset (&smask, SIGTERM);
+    sigaddset (&smask, SIGQUIT);
+    sigaddset (&smask, SIGTTOU);	// To take the tty back from the shell
+    sigprocmask (SIG_BLOCK, &smask, &omask);
+    int sfd = signalfd (-1, &smask, SFD_NONBLOCK| SFD_CLOEXEC);
+    int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK| TFD_CLOEXEC);
+    int efd = epoll_create1 (EPOLL_CLOEXEC);
+    struct epoll_event ev = { EPOLLIN, { .fd = sfd } };
+    if (sfd < 0 || tfd < 0 || efd < 0 || 0 != epoll_ctl (efd, EPOLL_CTL_ADD, sfd, &ev))
+	ExitWithError ("signalfd");
+    ev.data.fd = tfd;
+    if (0 != epoll_ctl (efd, EPOLL_CTL_ADD, tfd, &ev))
+	ExitWithError ("timerfd");
 
-    /* pid_t xpid = 0; */
-    /* if (0 == access (xinitrcPath, R_OK)) */
-	/* xpid = LaunchX (acct); */
-    pid_t shellpid = LaunchShell (acct, /* xpid ? ".xinitrc" : */ NULL);
-    if (!shellpid)
-	return;
+    // Processes orphaned in the session are reparented here, to be ended with it
+    prctl (PR_SET_CHILD_SUBREAPER, 1);
+
+    bool quitting = false;
 
-    WriteUtmp (acct, shellpid, USER_PROCESS);
-
-    // Set session signal handlers that quit
-    typedef void (*psigfunc_t)(int);
-    psigfunc_t hupsig = signal (SIGHUP, QuitSignal);
-    psigfunc_t termsig = signal (SIGTERM, QuitSignal);
-    psigfunc_t quitsig = signal (SIGQUIT, QuitSignal);
-    psigfunc_t alrmsig = signal (SIGALRM, AlarmSignal);
-    signal (SIGCHLD, ChildSignal);
-
-    sigset_t smask;
-    sigprocmask (SIG_UNBLOCK, NULL, &smask);
-
-    while (shellpid /* || xpid */) {
-	sigsuspend (&smask);
-	int chldstat = 0;
-	pid_t cpid = waitpid (-1, &chldstat, WNOHANG);
-	if (cpid == shellpid /* || cpid == xpid */) {
-	    if (cpid == shellpid)
-		shellpid = 0;
-	    /* else if (cpid == xpid) */
-		/* xpid = 0; */
-	    _quitting = true;
-	    alarm (KILL_TIMEOUT);
+    // Check if need to launch X. The X server is a child like any other
+    // session process, so it is ended with the session when .xinitrc exits.
+    char xinitrcPath [PATH_MAX], display [16] = "";
+    snprintf (xinitrcPath, sizeof(xinitrcPath), "%s/.xinitrc", acct->dir);
+    if (0 == access (xinitrcPath, R_OK))
+	LaunchX (acct, display, sizeof(display), &omask);
+    pid_t shellpid = LaunchShell (acct, display[0] ? display : NULL, &omask);
+    if (shellpid) {
+	WriteUtmp (acct, shellpid, USER_PROCESS);
+
+	// Without pidfd support, the shell exit is seen as SIGCHLD
+	int pfd = pidfd_open (shellpid, 0);
+	ev.data.fd = pfd;
+	if (pfd >= 0 && 0 != epoll_ctl (efd, EPOLL_CTL_ADD, pfd, &ev)) {
+	    close (pfd);
+	    pfd = -1;
 	}
-	if (_quitting) {
-	    if (shellpid)
-		kill (shellpid, _killsig);
-	    /* if (xpid) */
-		/* kill (xpid, _killsig); */
+
+	int killsig = SIGTERM;
+	while (shellpid) {
+	    if (0 > epoll_wait (efd, &ev, 1, -1)) {
+		if (errno == EINTR)
+		    continue;
+		ExitWithError ("epoll_wait");
+	    }
+	    struct signalfd_siginfo si;
+	    while (sizeof(si) == read (sfd, &si, sizeof(si))) {
+		if (si.ssi_signo != SIGCHLD && !quitting) {
+		    syslog (LOG_INFO, "shutting down session on signal %u", si.ssi_signo);
+		    quitting = true;
+		    const struct itimerspec kt = {{ 0, 0 }, { KILL_TIMEOUT/1000, KILL_TIMEOUT%1000*1000000 }};
+		    timerfd_settime (tfd, 0, &kt, NULL);
+		}
+	    }
+	    uint64_t nexp;
+	    if (sizeof(nexp) == read (tfd, &nexp, sizeof(nexp))) {
+		syslog (LOG_WARNING, "session hung; switching to SIGKILL");
+		killsig = SIGKILL;
+	    }
+	    int status;
+	    struct rusage ru;
+	    for (pid_t cpid; 0 < (cpid = wait4 (-1, &status, WNOHANG, &ru));) {
+		if (ReapedMotdGenerator (cpid, status))
+		    continue;
+		MetricsSessionChild (status, &ru, cpid == shellpid);
+		if (cpid == shellpid)
+		    shellpid = 0;
+	    }
+	    if (quitting && shellpid)
+		kill (shellpid, killsig);
 	}
+	if (pfd >= 0)
+	    close (pfd);
     }
+    EndSession (&smask, &quitting);
+    MetricsSessionEnd();
+    tcsetpgrp (STDIN_FILENO, getpgrp());
+    close (efd);
+    close (tfd);
+    close (sfd);
+    sigprocmask (SIG_SETMASK, &omask, NULL);
 
-    // Restore main signal handlers
-    signal (SIGCHLD, SIG_IGN);
-    signal (SIGALRM, alrmsig);
-    signal (SIGQUIT, termsig);
-    signal (SIGTERM, quitsig);
-    signal (SIGHUP, hupsig);
-    alarm (0);
-
-    WriteUtmp (acct, shellpid, DEAD_PROCESS);
     // Leave the user directory to allow it to be unmounted, if it is remote
     chdir ("/");
+    return (!quitting);
 }
 
-static void QuitSignal (int sig)
+// Signals all children, which for a subreaper includes orphaned session processes
+static unsigned SignalChildren (int sig)
 {
-    syslog (LOG_INFO, "shutting down session on signal %d", sig);
-    _quitting = true;
-    alarm (KILL_TIMEOUT);
+    DIR* d = opendir ("/proc");
+    if (!d)
+	return (0);
+    const pid_t self = getpid(), generator = MotdGenerator();
+    unsigned n = 0;
+    for (const struct dirent* e; (e = readdir (d));) {
+	const pid_t pid = atoi (e->d_name);
+	if (pid <= 0)
+	    continue;
+	char path [32], buf [256];
+	snprintf (path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open (path, O_RDONLY| O_CLOEXEC);
+	if (fd < 0)
+	    continue;
+	ssize_t br = read (fd, buf, sizeof(buf)-1);
+	close (fd);
+	if (br <= 0)
+	    continue;
+	buf[br] = 0;
+	// The parent pid follows the state, after the command name in parentheses
+	const char* cmdend = strrchr (buf, ')');
+	int ppid = 0;
+	if (!cmdend || 1 != sscanf (cmdend, ") %*c %d", &ppid) || ppid != self || pid == generator)
+	    continue;
+	kill (pid, sig);
+	kill (pid, SIGCONT);	// Stopped jobs would not see sig until continued
+	++n;
+    }
+    closedir (d);
+    return (n);
 }
 
-static void AlarmSignal (int sig __attribute__((unused)))
+// Terminates and reaps everything left in the session after the shell exits,
+// escalating to SIGKILL after KILL_TIMEOUT and giving up at SESSION_END_TIMEOUT.
+// A signal to end the session received meanwhile sets quitting, as it
+// would have during the session.
+static void EndSession (const sigset_t* smask, bool* quitting)
 {
-    syslog (LOG_WARNING, "session hung; switching to SIGKILL");
-    _quitting = true;
-    _killsig = SIGKILL;
+    struct timespec start, now;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    unsigned nended = 0, nleft;
+    long elapsed;
+    for (;;) {
+	int status;
+	struct rusage ru;
+	for (pid_t cpid; 0 < (cpid = wait4 (-1, &status, WNOHANG, &ru));) {
+	    if (ReapedMotdGenerator (cpid, status))
+		continue;
+	    MetricsSessionChild (status, &ru, false);
+	    ++nended;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000;
+	const int sig = elapsed < KILL_TIMEOUT ? SIGTERM : SIGKILL;
+	if (!(nleft = SignalChildren (sig)) || elapsed >= SESSION_END_TIMEOUT)
+	    break;
+	// Wait for a child to exit, or until it is time to escalate
+	long wait = (sig == SIGTERM ? KILL_TIMEOUT : SESSION_END_TIMEOUT) - elapsed;
+	if (wait > 100)	// Orphans reparented here do not raise SIGCHLD, so check for them periodically
+	    wait = 100;
+	const struct timespec to = { wait/1000, wait%1000*1000000 };
+	const int s = sigtimedwait (smask, NULL, &to);
+	if ((s == SIGHUP || s == SIGTERM || s == SIGQUIT) && !*quitting) {
+	    syslog (LOG_INFO, "shutting down on signal %d", s);
+	    *quitting = true;
+	}
+    }
+    if (nleft)
+	syslog (LOG_WARNING, "session end: %u processes ended and %u left after %ld ms", nended, nleft, elapsed);
+    else if (nended)
+	syslog (LOG_INFO, "session end: %u processes ended in %ld ms", nended, elapsed);
 }
 
-/* static void XreadySignal (int sig __attribute__((unused))) */
-/* { */
-/*     _xready = true; */
-/* } */
+// Reports an error from a vfork child without touching the shared memory
+static void ChildWarning (const char* fn, const char* msg)
+{
+    const char* err = strerror (errno);
+    struct iovec iov[] = {{ (void*) fn, strlen(fn) }, { (void*) ": ", 2 }, { (void*) err, strlen(err) }, { (void*) msg, strlen(msg) }};
+    writev (STDERR_FILENO, iov, sizeof(iov)/sizeof(iov[0]));
+}
 
-static void ChildSignal (int sig __attribute__((unused)))
+// Reports an error from a vfork child and exits
+static void ChildError (const char* fn)
 {
+    ChildWarning (fn, "\n");
+    _exit (EXIT_FAILURE);
 }
 
-static void BecomeUser (const struct account* acct)
+// Resets signal handlers in a vfork child, before it unblocks signals
+static void ResetChildSignals (const sigset_t* omask)
 {
-    if (0 != setgid (acct->gid))
-	perror ("setgid");
-    if (0 != setuid (acct->uid))
-	perror ("setuid");
+    for (int sig = 1; sig < NSIG; ++sig) {
+	struct sigaction sa;
+	if (0 == sigaction (sig, NULL, &sa) && sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN)
+	    signal (sig, SIG_DFL);
+    }
+    sigprocmask (SIG_SETMASK, omask, NULL);
+}
 
-    clearenv();
-    setenv ("TERM", _termname, false);
-    setenv ("PATH", _PATH_DEFPATH, false);
-    setenv ("USER", acct->name, true);
-    setenv ("SHELL", acct->shell, true);
-    setenv ("HOME", acct->dir, true);
+// Called in a vfork child, so only system calls are made. The credentials
+// are set with raw syscalls because the libc wrappers would try to change
+// them in every thread of the parent. If the home directory is missing or
+// not mounted, the user is logged in to / instead, as util-linux login
+// does, and HOME in envp, if given, is changed to match.
+static void BecomeUser (const struct account* acct, const char** envp)
+{
+    if (0 != syscall (SYS_setresgid, acct->gid, acct->gid, acct->gid))
+	ChildError ("setgid");
+    if (0 != syscall (SYS_setresuid, acct->uid, acct->uid, acct->uid))
+	ChildError ("setuid");
+    if (0 != chdir (acct->dir)) {
+	ChildWarning ("chdir", "\nLogging in with HOME=/\n");
+	if (0 != chdir ("/"))
+	    ChildError ("chdir");
+	for (; envp && *envp; ++envp)
+	    if (0 == strncmp (*envp, "HOME=", strlen("HOME=")))
+		*envp = "HOME=/";	// Only the envp array is changed, which the parent no longer needs
+    }
+}
 
-    if (0 != chdir (acct->dir))
-	perror ("chdir");
+// Builds the session environment in buf, pointed to by envp
+static void UserEnvironment (const struct account* acct, const char* display, char* buf, size_t bufsz, const char** envp)
+{
+    char xauthpath [PATH_MAX];
+    snprintf (xauthpath, sizeof(xauthpath), "%s/.config/Xauthority", acct->dir);
+    const char* vars[][2] = {
+	{ "TERM",	_termname },
+	{ "PATH",	_PATH_DEFPATH },
+	{ "USER",	acct->name },
+	{ "SHELL",	acct->shell },
+	{ "HOME",	acct->dir },
+	{ "DISPLAY",	display },	// If launching xinitrc
+	{ "XAUTHORITY",	xauthpath }
+    };
+    const unsigned nvars = sizeof(vars)/sizeof(vars[0]) - (display ? 0 : 2);
+    for (unsigned i = 0; i < nvars; ++i) {
+	int n = snprintf (buf, bufsz, "%s=%s", vars[i][0], vars[i][1]);
+	if (n < 0 || (size_t) n >= bufsz)
+	    break;
+	*envp++ = buf;
+	buf += n+1;
+	bufsz -= n+1;
+    }
+    *envp = NULL;
 }
 
 static void RedirectToLog (void)
@@ -138,88 +305,468 @@ static void RedirectToLog (void)
     close (fd);
 }
 
-static void WriteMotd (const struct account* acct)
+//{{{ Message of the day ----------------------------------------------
+
+// The message of the day is combined from the output of the generator
+// scripts, the static motd, and the fragments in the motd directory.
+// Generators can take seconds, so the result is cached, and rebuilt in
+// the background when a source changes or the cache gets too old. The
+// login always sends the cached copy, whatever the number of sources.
+
+enum { MAX_MOTD_SIZE = 64*1024 };
+
+struct motdbuf {
+    char*	data;
+    size_t	size;
+};
+
+static bool _motdupdating = false;	// Cleared by the updater thread when done
+
+// Generators may still run when the session starts, with loginx as the
+// subreaper, but are not session processes. The session reaper passes
+// the exit status of the running one to the updater, and does not count
+// it in the session metrics, and EndSession does not kill it.
+static pthread_mutex_t _motdgenlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _motdgencond = PTHREAD_COND_INITIALIZER;
+static pid_t _motdgenerator = 0;	// Of the running generator
+static int _motdgenstatus = 0;		// Its exit status, if _motdgenreaped
+static bool _motdgenreaped = false;
+
+static pid_t MotdGenerator (void)
 {
-    ClearScreen();
-    int fd = open ("/etc/motd", O_RDONLY);
+    pthread_mutex_lock (&_motdgenlock);
+    const pid_t pid = _motdgenerator;
+    pthread_mutex_unlock (&_motdgenlock);
+    return (pid);
+}
+
+// Called with each child reaped by the session; returns true if it was the motd generator
+static bool ReapedMotdGenerator (pid_t pid, int status)
+{
+    pthread_mutex_lock (&_motdgenlock);
+    const bool generator = pid == _motdgenerator;
+    if (generator) {
+	_motdgenstatus = status;
+	_motdgenreaped = true;
+	pthread_cond_broadcast (&_motdgencond);
+    }
+    pthread_mutex_unlock (&_motdgenlock);
+    return (generator);
+}
+
+// The cache is stale if too old or if any source, or any file in a source directory, changed after it
+static bool MotdIsFresh (void)
+{
+    struct stat st;
+    if (0 != stat (PATH_MOTD_CACHE, &st))
+	return (false);
+    const time_t built = st.st_mtime, now = time (NULL);
+    if (built > now || built + MOTD_CACHE_MAXAGE < now)
+	return (false);
+    static const char c_Sources[][32] = { PATH_MOTD, PATH_MOTD_DIR, PATH_MOTD_GENERATORS };
+    for (unsigned i = 0; i < sizeof(c_Sources)/sizeof(c_Sources[0]); ++i) {
+	if (0 != stat (c_Sources[i], &st))
+	    continue;
+	if (st.st_mtime >= built)
+	    return (false);
+	if (!S_ISDIR(st.st_mode))
+	    continue;
+	DIR* d = opendir (c_Sources[i]);
+	if (!d)
+	    continue;
+	bool changed = false;
+	for (const struct dirent* e; !changed && (e = readdir (d));)
+	    changed = e->d_name[0] != '.' && 0 == fstatat (dirfd(d), e->d_name, &st, 0) && st.st_mtime >= built;
+	closedir (d);
+	if (changed)
+	    return (false);
+    }
+    return (true);
+}
+
+// Appends the contents of fd, waiting up to timeout ms for it if non-negative
+static bool AppendMotd (struct motdbuf* mb, int fd, int timeout)
+{
+    for (;;) {
+	if (timeout >= 0) {
+	    struct pollfd pfd = { fd, POLLIN, 0 };
+	    int r = poll (&pfd, 1, timeout);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    else if (r <= 0)
+		return (false);
+	}
+	char buf [4096];
+	ssize_t br = read (fd, buf, sizeof(buf));
+	if (br < 0 && errno == EINTR)
+	    continue;
+	else if (br <= 0)
+	    return (br == 0);
+	size_t n = br;
+	if (n > MAX_MOTD_SIZE - mb->size)
+	    n = MAX_MOTD_SIZE - mb->size;
+	mb->data = (char*) xrealloc (mb->data, mb->size + n);
+	memcpy (mb->data + mb->size, buf, n);
+	mb->size += n;
+    }
+}
+
+static void AppendMotdFile (struct motdbuf* mb, const char* path)
+{
+    int fd = open (path, O_RDONLY| O_CLOEXEC);
     if (fd < 0)
 	return;
     struct stat st;
-    if (fstat (fd, &st) == 0 && S_ISREG(st.st_mode))
-	sendfile (STDOUT_FILENO, fd, NULL, st.st_size);
+    if (0 == fstat (fd, &st) && S_ISREG(st.st_mode))
+	AppendMotd (mb, fd, -1);
     close (fd);
+}
+
+// Runs a generator script and appends what it writes to stdout. Returns
+// false if the output may be incomplete, because the generator did not
+// finish in time or was killed.
+static bool AppendMotdGenerator (struct motdbuf* mb, const char* path)
+{
+    struct stat st;
+    if (0 != stat (path, &st) || !S_ISREG(st.st_mode) || 0 != access (path, X_OK))
+	return (true);
+    int pfd[2];
+    if (0 != pipe2 (pfd, O_CLOEXEC))
+	return (false);
+    sigset_t nomask;
+    sigemptyset (&nomask);
+    // Locked until the pid is recorded, for the session reaper to know it
+    pthread_mutex_lock (&_motdgenlock);
+    pid_t pid = vfork();
+    if (!pid) {
+	ResetChildSignals (&nomask);
+	int nfd = open (_PATH_DEVNULL, O_RDWR);	// The tty belongs to the login box
+	dup2 (nfd, STDIN_FILENO);
+	dup2 (pfd[1], STDOUT_FILENO);
+	dup2 (nfd, STDERR_FILENO);
+	execl (path, path, NULL);
+	_exit (EXIT_FAILURE);
+    }
+    _motdgenerator = pid > 0 ? pid : 0;
+    _motdgenreaped = false;
+    pthread_mutex_unlock (&_motdgenlock);
+    close (pfd[1]);
+    bool ok = false;
+    if (pid > 0) {
+	if (!(ok = AppendMotd (mb, pfd[0], MOTD_GENERATOR_TIMEOUT))) {
+	    syslog (LOG_WARNING, "motd generator %s timed out", path);
+	    kill (pid, SIGKILL);
+	}
+	int status = 0;
+	pid_t r;
+	while (0 > (r = waitpid (pid, &status, 0)) && errno == EINTR) {}
+	pthread_mutex_lock (&_motdgenlock);
+	if (r != pid) {	// Reaped by the session, which passes on the status
+	    while (!_motdgenreaped)
+		pthread_cond_wait (&_motdgencond, &_motdgenlock);
+	    status = _motdgenstatus;
+	}
+	_motdgenerator = 0;
+	pthread_mutex_unlock (&_motdgenlock);
+	if (ok && WIFSIGNALED(status)) {
+	    syslog (LOG_WARNING, "motd generator %s killed by signal %d", path, WTERMSIG(status));
+	    ok = false;
+	}
+    }
+    close (pfd[0]);
+    return (ok);
+}
+
+static bool AppendMotdFragment (struct motdbuf* mb, const char* path)
+{
+    AppendMotdFile (mb, path);
+    return (true);
+}
+
+// Calls fn with each file in dir, in alphabetical order. Returns false if any call did.
+static bool ForEachMotdFragment (struct motdbuf* mb, const char* dir, bool (*fn)(struct motdbuf*, const char*))
+{
+    bool ok = true;
+    struct dirent** names = NULL;
+    int n = scandir (dir, &names, NULL, alphasort);
+    for (int i = 0; i < n; ++i) {
+	if (names[i]->d_name[0] != '.') {
+	    char path [PATH_MAX];
+	    snprintf (path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+	    ok &= fn (mb, path);
+	}
+	free (names[i]);
+    }
+    free (names);
+    return (ok);
+}
+
+static void* MotdUpdater (void* arg __attribute__((unused)))
+{
+    if (!MotdIsFresh()) {
+	unsigned t = TraceBegin ("UpdateMotd");
+	struct motdbuf mb = { NULL, 0 };
+	const bool complete = ForEachMotdFragment (&mb, PATH_MOTD_GENERATORS, AppendMotdGenerator);
+	AppendMotdFile (&mb, PATH_MOTD);
+	ForEachMotdFragment (&mb, PATH_MOTD_DIR, AppendMotdFragment);
+	if (complete)	// Otherwise the old cache is kept, and rebuilt again at the next login
+	    WriteCacheFile (PATH_MOTD_CACHE, mb.data, mb.size);
+	xfree (mb.data);
+	TraceEnd (t);
+    }
+    __atomic_store_n (&_motdupdating, false, __ATOMIC_RELEASE);
+    return (NULL);
+}
+
+// Rebuilds the cached message of the day in the background, if it is stale
+void UpdateMotd (void)
+{
+    if (__atomic_load_n (&_motdupdating, __ATOMIC_ACQUIRE))
+	return;
+    // The updater may outlive the login box, and must not take the session signals
+    sigset_t all, omask;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &omask);
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t updater;
+    _motdupdating = true;
+    if (0 != pthread_create (&updater, &attr, MotdUpdater, NULL))
+	_motdupdating = false;
+    pthread_attr_destroy (&attr);
+    pthread_sigmask (SIG_SETMASK, &omask, NULL);
+}
+
+static void WriteMotd (const struct account* acct)
+{
+    ClearScreen();
+    int fd = open (PATH_MOTD_CACHE, O_RDONLY| O_CLOEXEC);
+    if (fd < 0)	// Until the cache is first built
+	fd = open (PATH_MOTD, O_RDONLY| O_CLOEXEC);
+    if (fd >= 0) {
+	struct stat st;
+	if (fstat (fd, &st) == 0 && S_ISREG(st.st_mode))
+	    sendfile (STDOUT_FILENO, fd, NULL, st.st_size);
+	close (fd);
+    }
     const time_t lltime = acct->ltime;
     printf ("Last login: %s\n", ctime(&lltime));
     fflush (stdout);
 }
 
-/* static pid_t LaunchX (const struct account* acct) */
-/* { */
-/*     signal (SIGUSR1, XreadySignal); */
-
-/*     // Block delivery of SIGUSR1 until ready to avoid race conditions */
-/*     sigset_t busr, orig; */
-/*     sigemptyset (&busr); */
-/*     sigaddset (&busr, SIGUSR1); */
-/*     sigprocmask (SIG_BLOCK, &busr, &orig); */
-
-/*     pid_t pid = fork(); */
-/*     if (pid > 0) { */
-/* 	sigprocmask (SIG_SETMASK, &orig, NULL);	// Now unblock SIGUSR1 */
-/* 	for (;;) { */
-/* 	    sigsuspend (&orig);	// Wait for SIGUSR1 from X before returning */
-/* 	    int ecode, rc = waitpid (pid, &ecode, WNOHANG); */
-/* 	    if (rc || errno != EINTR) */
-/* 		return (0);	// X failed to start, fallback to plain shell */
-/* 	    else if (_xready) */
-/* 		break; */
-/* 	} */
-/* 	return (pid); */
-/*     } else if (pid < 0) */
-/* 	ExitWithError ("fork"); */
-/*     BecomeUser (acct); */
-/*     unlink (PATH_SESSION_LOG); */
-/*     RedirectToLog(); */
-
-/*     signal (SIGTTIN, SIG_IGN);	// Ignore server reads and writes */
-/*     signal (SIGTTOU, SIG_IGN); */
-/*     signal (SIGUSR1, SIG_IGN);	// This tells the X server to send SIGUSR1 to parent when ready */
-/*     sigprocmask (SIG_SETMASK, &orig, NULL);	// Now unblock SIGUSR1 */
-
-/*     char vtname[] = "vt01"; */
-/*     vtname[3] = _ttypath[strlen(_ttypath)-1]; */
-/*     const char* argv[] = { "X", ":0", vtname, "-quiet", "-nolisten", "tcp", "-auth", ".config/Xauthority", NULL }; */
-/*     if (0 != access (argv[7], R_OK)) */
-/* 	argv[6] = NULL; */
-/*     execvp ("/usr/bin/X", (char* const*) argv); */
-/*     ExitWithError ("execvp"); */
-/* } */
-
-static pid_t LaunchShell (const struct account* acct, const char* arg)
-{
-    pid_t pid = fork();
-    if (pid > 0)
-	return (pid);
-    else if (pid < 0)
-	ExitWithError ("fork");
-    BecomeUser (acct);
-
-    if (arg) {	// If launching xinitrc, set DISPLAY
-	setenv ("DISPLAY", ":0", true);
-	char xauthpath [PATH_MAX];
-	snprintf (xauthpath, sizeof(xauthpath), "%s/.config/Xauthority", acct->dir);
-	setenv ("XAUTHORITY", xauthpath, true);
+//}}}-------------------------------------------------------------------
+//{{{ Session prefetch
+
+// While the password is typed, the groups of the highlighted account
+// are resolved, its home directory is opened, which mounts it if
+// automounted, and the shell and the startup files it will read are
+// scheduled for readahead. On network
+// homes this takes most of the time to the first prompt off the login.
+// A new selection abandons the previous one between files. Any account
+// can be highlighted without a password, so the files in its home are
+// opened with its filesystem uid, and never through a symlink, to not
+// open as root a device a user linked to from a startup file.
+
+static pthread_mutex_t _prefetchlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _prefetchcond = PTHREAD_COND_INITIALIZER;
+static unsigned _prefetchgen = 0;	// Incremented for each new selection
+static char _prefetchname [256];
+static char _prefetchdir [PATH_MAX];
+static char _prefetchshell [PATH_MAX];
+static uid_t _prefetchuid = 0;
+static gid_t _prefetchgid = 0;
+static bool _prefetcherstarted = false;
+
+static void PrefetchFile (int dirfd, const char* path, int flags)
+{
+    // O_NONBLOCK, because an open of a fifo would block
+    int fd = openat (dirfd, path, O_RDONLY| O_NONBLOCK| O_NOCTTY| O_CLOEXEC| flags);
+    if (fd < 0)
+	return;
+    struct stat st;
+    if (0 == fstat (fd, &st) && S_ISREG(st.st_mode))
+	posix_fadvise (fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    close (fd);
+}
+
+static void* SessionPrefetcher (void* arg __attribute__((unused)))
+{
+    static const char c_StartupFiles[][24] = {
+	".profile", ".bash_profile", ".bash_login", ".bashrc",
+	".zshenv", ".zprofile", ".zshrc", ".xinitrc", ".config/Xauthority"
+    };
+    for (unsigned done = 0;;) {
+	char name [sizeof(_prefetchname)], dir [PATH_MAX], shell [PATH_MAX];
+	pthread_mutex_lock (&_prefetchlock);
+	while (_prefetchgen == done)
+	    pthread_cond_wait (&_prefetchcond, &_prefetchlock);
+	done = _prefetchgen;
+	strcpy (name, _prefetchname);
+	strcpy (dir, _prefetchdir);
+	strcpy (shell, _prefetchshell);
+	const uid_t uid = _prefetchuid;
+	const gid_t gid = _prefetchgid;
+	pthread_mutex_unlock (&_prefetchlock);
+
+	// Groups first, because they are needed right after the password is checked
+	ResolveGroups (name, uid, gid);
+	if (done != __atomic_load_n (&_prefetchgen, __ATOMIC_RELAXED))
+	    continue;
+	PrefetchFile (AT_FDCWD, shell, 0);	// From passwd, so may be a symlink, like /bin/sh
+	// The filesystem ids are per thread, so only this thread is affected
+	setfsgid (gid);
+	setfsuid (uid);
+	int dfd = open (dir, O_RDONLY| O_DIRECTORY| O_CLOEXEC);
+	for (unsigned i = 0; dfd >= 0 && i < sizeof(c_StartupFiles)/sizeof(c_StartupFiles[0]); ++i) {
+	    if (done != __atomic_load_n (&_prefetchgen, __ATOMIC_RELAXED))
+		break;	// Selection changed
+	    PrefetchFile (dfd, c_StartupFiles[i], O_NOFOLLOW);
+	}
+	if (dfd >= 0)
+	    close (dfd);
+	setfsuid (geteuid());
+	setfsgid (getegid());
+    }
+    return (NULL);
+}
+
+// Starts warming the caches for the session of acct, abandoning the previous one
+void PrefetchSession (const struct account* acct)
+{
+    pthread_mutex_lock (&_prefetchlock);
+    snprintf (_prefetchname, sizeof(_prefetchname), "%s", acct->name);
+    _prefetchuid = acct->uid;
+    _prefetchgid = acct->gid;
+    snprintf (_prefetchdir, sizeof(_prefetchdir), "%s", acct->dir);
+    snprintf (_prefetchshell, sizeof(_prefetchshell), "%s", acct->shell);
+    __atomic_add_fetch (&_prefetchgen, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal (&_prefetchcond);
+    pthread_mutex_unlock (&_prefetchlock);
+    if (_prefetcherstarted)
+	return;
+
+    // The prefetcher lives on through the session, so it must not take the session signals
+    sigset_t all, omask;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &omask);
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t prefetcher;
+    _prefetcherstarted = (0 == pthread_create (&prefetcher, &attr, SessionPrefetcher, NULL));
+    pthread_attr_destroy (&attr);
+    pthread_sigmask (SIG_SETMASK, &omask, NULL);
+}
+
+//}}}-------------------------------------------------------------------
+
+// Starts the X server and waits until it is ready to accept clients.
+// The server writes its display number to the -displayfd pipe when it
+// is, or the pipe is closed if it dies first. Returns 0 if X could not
+// be started, and the session then falls back to the plain shell.
+static pid_t LaunchX (const struct account* acct, char* display, size_t displaysz, const sigset_t* omask)
+{
+    int xfd[2];
+    if (0 != pipe2 (xfd, O_CLOEXEC))
+	return (0);
+
+    char vtname [8] = "vt01", fdname [8], xauthpath [PATH_MAX];
+    const char* ttynum = _ttypath + strcspn (_ttypath, "0123456789");
+    if (*ttynum)
+	snprintf (vtname, sizeof(vtname), "vt%02d", atoi(ttynum));
+    snprintf (fdname, sizeof(fdname), "%d", xfd[1]);
+    snprintf (xauthpath, sizeof(xauthpath), "%s/.config/Xauthority", acct->dir);
+    const char* argv[] = { "X", "-displayfd", fdname, vtname, "-quiet", "-nolisten", "tcp", "-auth", xauthpath, NULL };
+    if (0 != access (xauthpath, R_OK))
+	argv[7] = NULL;
+
+    unsigned t = TraceBegin ("xstart");
+    pid_t pid = vfork();
+    if (!pid) {
+	ResetChildSignals (omask);
+	signal (SIGTTIN, SIG_IGN);	// Ignore server reads and writes
+	signal (SIGTTOU, SIG_IGN);
+	fcntl (xfd[1], F_SETFD, 0);	// Keep the readiness pipe open in the server
+	BecomeUser (acct, NULL);
+	unlink (PATH_SESSION_LOG);
 	RedirectToLog();
+	execv (PATH_X_SERVER, (char* const*) argv);
+	ChildError ("execv");
+    }
+    close (xfd[1]);
+    if (pid < 0) {
+	close (xfd[0]);
+	return (0);
+    }
+
+    // Read the display number until the newline, EOF, or timeout
+    struct timespec now, end;
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    end.tv_sec += X_START_TIMEOUT/1000;
+    end.tv_nsec += X_START_TIMEOUT%1000*1000000;
+    char dnum [8];
+    size_t dl = 0;
+    for (int timeout; dl < sizeof(dnum) && !memchr (dnum, '\n', dl);) {
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	timeout = (end.tv_sec-now.tv_sec)*1000 + (end.tv_nsec-now.tv_nsec)/1000000;
+	struct pollfd pfd = { xfd[0], POLLIN, 0 };
+	int r = timeout > 0 ? poll (&pfd, 1, timeout) : 0;
+	if (r < 0 && errno == EINTR)
+	    continue;
+	ssize_t br = r > 0 ? read (xfd[0], dnum+dl, sizeof(dnum)-dl) : 0;
+	if (br <= 0)
+	    break;
+	dl += br;
     }
-    WriteMotd (acct);
+    close (xfd[0]);
+    TraceEnd (t);
+    if (!dl || !memchr (dnum, '\n', dl)) {
+	syslog (LOG_ERR, "X server did not start; falling back to the shell");
+	kill (pid, SIGTERM);	// Reaped with the session
+	return (0);
+    }
+    snprintf (display, displaysz, ":%.*s", (int) strcspn (dnum, "\n"), dnum);
+    return (pid);
+}
 
+static pid_t LaunchShell (const struct account* acct, const char* display, const sigset_t* omask)
+{
+    // The shell is started with vfork, to not copy the page tables of a
+    // process that by now has the accounts, PAM, and curses mapped. The
+    // child shares memory with this process until exec, so everything it
+    // needs is prepared here and it makes only system calls.
     char shname [16];	// argv[0] of a login shell is "-bash"
     const char* shbasename = strrchr(acct->shell, '/');
     if (!shbasename++)
 	shbasename = acct->shell;
     snprintf (shname, sizeof(shname), "-%s", shbasename);
-
+    const char* arg = display ? ".xinitrc" : NULL;
     const char* argv[] = { shname, arg, NULL };
-    execvp (acct->shell, (char* const*) argv);
-    ExitWithError ("execvp");
+
+    char envbuf [3*PATH_MAX];
+    const char* envp [8];
+    UserEnvironment (acct, display, envbuf, sizeof(envbuf), envp);
+
+    if (!display)	// With X, the console is not seen
+	WriteMotd (acct);
+
+    unsigned t = TraceBegin ("spawn");
+    pid_t pid = vfork();
+    if (!pid) {
+	// The shell gets its own process group in the foreground
+	setpgid (0, 0);
+	tcsetpgrp (STDIN_FILENO, getpid());
+	ResetChildSignals (omask);
+	BecomeUser (acct, envp);
+	if (arg)
+	    RedirectToLog();
+	execve (acct->shell, (char* const*) argv, (char* const*) envp);
+	ChildError ("execve");
+    } else if (pid < 0)
+	ExitWithError ("vfork");
+    TraceEnd (t);	// vfork returns when the child has called exec
+    MetricsSessionStart();
+    TraceFlush();
+    return (pid);
 }